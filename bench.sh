@@ -4,14 +4,72 @@ set -x
 rm -rf .temp
 mkdir -p .temp
 
-for i in boost boost8 boostr boostr8 ska ska8 skar skar8; do
-    g++ -O5 -march=native profiling/"$i".cc -o .temp/"$i"
-    ./.temp/"$i" > .temp/"$i".csv
-done
-
-for i in swiss swiss8 swissr swissr8; do
-    gcc -O5 -march=native -D__AVX2__ profiling/"$i".c xxhash3.c hash.c -o .temp/"$i"
-    ./.temp/"$i" > .temp/"$i".csv
-done
+g++ -O5 -march=native profiling/boost.cc -o .temp/boost
+g++ -O5 -march=native profiling/ska.cc -o .temp/ska
+gcc -O5 -march=native -D__AVX2__ profiling/swiss.c xxhash3.c hash.c -o .temp/swiss -lm -pthread
+gcc -O5 -march=native -D__AVX2__ profiling/threads.c xxhash3.c hash.c -o .temp/threads -lm -pthread
+
+# group name, then the driver arguments for that shape (see plot.py)
+while read -r group args; do
+    for i in boost ska swiss; do
+        ./.temp/"$i" $args -H .temp/"$i"_"$group"_hist.csv > .temp/"$i"_"$group".csv
+        ./.temp/"$i" $args -t 1000 -P .temp/"$i"_"$group"_perf.csv > .temp/"$i"_"$group"_tp.csv
+    done
+done <<SHAPES
+k1024v1024 -k 1024 -v 1024 -n 1000000 -r
+k8v8 -k 8 -v 8 -n 1000000 -r
+k1024v1024r -k 1024 -v 1024 -n 3000000 -r -m 1:1:1
+k8v8r -k 8 -v 8 -n 3000000 -r -m 1:1:1
+k16v64 -k 16 -v 64 -n 1000000 -r
+k32v8 -k 32 -v 8 -n 1000000 -r
+k8v8x50 -k 8 -v 8 -n 1000000 -r -x 50
+k32v8x50 -k 32 -v 8 -n 1000000 -r -x 50
+k8v8d50 -k 8 -v 8 -n 1000000 -r -D 50 -x 50
+k8v8z0.5 -k 8 -v 8 -n 1000000 -r -z 0.5
+k8v8z0.99 -k 8 -v 8 -n 1000000 -r -z 0.99
+k8v8z1.2 -k 8 -v 8 -n 1000000 -r -z 1.2
+k8v8w4096 -k 8 -v 8 -n 1000000 -r -w 4096
+k16v64z0.5 -k 16 -v 64 -n 1000000 -r -z 0.5
+k16v64z0.99 -k 16 -v 64 -n 1000000 -r -z 0.99
+k16v64z1.2 -k 16 -v 64 -n 1000000 -r -z 1.2
+k16v64w4096 -k 16 -v 64 -n 1000000 -r -w 4096
+SHAPES
+
+# lookup hit/miss cost at increasing fill levels of a map reserved for n
+while read -r group args; do
+    for i in boost ska swiss; do
+        ./.temp/"$i" $args > .temp/"$i"_"$group"_sweep.csv
+    done
+done <<SWEEPS
+k8v8 -k 8 -v 8 -n 1000000 -r -L 10,25,50,75,90,100
+k32v8 -k 32 -v 8 -n 1000000 -r -L 10,25,50,75,90,100
+SWEEPS
+
+# allocated bytes and RSS while inserting n keys into an unreserved map
+while read -r group args; do
+    for i in boost ska swiss; do
+        ./.temp/"$i" $args -M > .temp/"$i"_"$group"_mem.csv
+    done
+done <<MEMORY
+k8v8 -k 8 -v 8 -n 1000000
+k16v64 -k 16 -v 64 -n 1000000
+k32v8 -k 32 -v 8 -n 1000000
+k1024v1024 -k 1024 -v 1024 -n 1000000
+MEMORY
+
+# every resize while inserting n keys into an unreserved map
+while read -r group args; do
+    for i in boost ska swiss; do
+        ./.temp/"$i" $args -G > .temp/"$i"_"$group"_grow.csv
+    done
+done <<GROWS
+k8v8 -k 8 -v 8 -n 1000000
+k16v64 -k 16 -v 64 -n 1000000
+k32v8 -k 32 -v 8 -n 1000000
+k1024v1024 -k 1024 -v 1024 -n 1000000
+GROWS
+
+# aggregate throughput of shared, private and locked maps by thread count
+./.temp/threads -k 8 -v 8 -n 1000000 -T 1,2,4,8,16 > .temp/threads_k8v8.csv
 
 python3 plot.py
@@ -2,10 +2,11 @@
 set -x
 rm -rf .temp 
 mkdir -p .temp 
-cp *.c *.h profiling/swiss.c .temp
+cp *.c *.h profiling/swiss.c profiling/bench.h .temp
 cd .temp
-cc -fprofile-arcs -ftest-coverage -Wall -Wextra -march=native -D__AVX2__ -O5 xxhash3.c hash.c swiss.c -o profile
-./profile
+cc -Wall -Wextra -O2 xxhash3.c hash.c test.c -o test -lm -pthread && ./test || exit 1
+cc -fprofile-arcs -ftest-coverage -Wall -Wextra -march=native -D__AVX2__ -O5 xxhash3.c hash.c swiss.c -o profile -lm -pthread
+./profile -n 100000 && ./profile -n 100000 -m 1:1:1
 wait
 #gcov -a -b -c -g profile-profiling.c profile-hash.c profile-xxhash3.c
 gcovr --html-nested covr.html
@@ -1,10 +1,19 @@
 #include "hash.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #ifndef NULL
 #define NULL (void*)0
@@ -13,9 +22,17 @@
 #ifdef __AVX2__
 #include <immintrin.h>
 #define GROUP_SIZE 32
+#define GROUP_WIDTH 32
 #else
 #include <emmintrin.h>
 #define GROUP_SIZE 8
+#define GROUP_WIDTH 16
+#endif
+
+#ifdef SM_INSTRUMENT
+#define SM_COUNT(m, field, n) ((m)->counters.field += (n))
+#else
+#define SM_COUNT(m, field, n) ((void)0)
 #endif
 
 #if __GNUC__ >= 3
@@ -33,8 +50,56 @@ typedef struct {
     void *vals;
     uint64_t cap, size;
     uint64_t lgcap;
+    uint64_t tombstones;
+    sm_dirty_t *dirty;
+    sm_wal_t *wal;
+    SM_COUNTERS_FIELD
 } swiss_map_generic_t;
 
+// One bit per region of 1 << shift slots, set when a slot in the region may
+// have changed since the full snapshot base_id was written. all is set when
+// the layout itself changed (a grow or clear), so only a full write will do.
+struct sm_dirty {
+    uint64_t shift;
+    int all;
+    uint64_t base_id;
+    uint64_t bits[];
+};
+
+static sm_dirty_t *dirty_new(uint64_t cap, uint64_t shift) {
+    uint64_t regions = (cap >> shift) ? cap >> shift : 1;
+    sm_dirty_t *d = calloc(1, sizeof(*d) + (regions + 63) / 64 * sizeof(uint64_t));
+    if (!d) return NULL;
+    d->shift = shift;
+    d->all = 1;
+    return d;
+}
+
+static inline void dirty_mark(swiss_map_generic_t *m, uint64_t pos) {
+    if (unlikely(m->dirty)) {
+        uint64_t r = pos >> m->dirty->shift;
+        m->dirty->bits[r >> 6] |= 1ull << (r & 63);
+    }
+}
+
+// Write-ahead log hooks, defined with the log below.
+#define WAL_SKIP  0
+#define WAL_PUT   1
+#define WAL_DEL   2
+#define WAL_CLEAR 3
+static int wal_log(swiss_map_generic_t *m, int op, uint64_t slot, const void *key);
+static int wal_release(swiss_map_generic_t *m);
+
+// After the capacity changed: the old bitmap has the wrong number of regions
+// and every region moved anyway.
+static void dirty_reset(swiss_map_generic_t *m) {
+    if (m->dirty) {
+        sm_dirty_t *d = dirty_new(m->cap, m->dirty->shift);
+        free(m->dirty);
+        m->dirty = d;
+    }
+}
+
 static uint64_t fnv1a(const void *data, uint64_t len) {
     const uint8_t *p = data;
     uint64_t h = 14695981039346656037ULL;
@@ -96,6 +161,19 @@ static void sm_unalloc(void* ctx, void* p) {
     free(p);
 }
 
+// Allocates ctrl, keys and vals for cap slots. If any allocation fails the
+// others are freed and -1 returned with errno ENOMEM.
+static int alloc_arrays(const sm_allocator_t *a, uint64_t cap, uint64_t key_size, uint64_t val_size, uint8_t **ctrl, void **keys, void **vals) {
+    *ctrl = a->alloc(a->ctx, cap + GROUP_WIDTH);
+    *keys = *ctrl ? a->alloc(a->ctx, cap * key_size) : NULL;
+    *vals = *keys ? a->alloc(a->ctx, cap * val_size) : NULL;
+    if (likely(*vals)) return 0;
+    if (*keys) a->free(a->ctx, *keys);
+    if (*ctrl) a->free(a->ctx, *ctrl);
+    errno = ENOMEM;
+    return -1;
+}
+
 void *sm_new(uint64_t init_cap, uint64_t key_size, uint64_t val_size, sm_allocator_t allocs) {
     if (allocs.alloc == NULL || allocs.free == NULL) {
         allocs.ctx = NULL;
@@ -106,23 +184,37 @@ void *sm_new(uint64_t init_cap, uint64_t key_size, uint64_t val_size, sm_allocat
         allocs.hash = fnv1a;
 
     swiss_map_generic_t *m = allocs.alloc(allocs.ctx, sizeof(*m));
+    if (unlikely(!m)) {
+        errno = ENOMEM;
+        return NULL;
+    }
     m->alloc = allocs;
-    m->cap = next_pow2(init_cap);
+    m->cap = next_pow2(init_cap < GROUP_WIDTH ? GROUP_WIDTH : init_cap);
     m->lgcap = __builtin_ctzll(m->cap);
     m->size = 0;
-    m->ctrl = allocs.alloc(allocs.ctx, m->cap + GROUP_SIZE);
-    memset(m->ctrl, EMPTY, m->cap + GROUP_SIZE);
-    m->keys = allocs.alloc(allocs.ctx, m->cap * key_size);
-    m->vals = allocs.alloc(allocs.ctx, m->cap * val_size);
+    m->tombstones = 0;
+    m->dirty = NULL;
+    m->wal = NULL;
+#ifdef SM_INSTRUMENT
+    memset(&m->counters, 0, sizeof(m->counters));
+#endif
+    if (unlikely(alloc_arrays(&allocs, m->cap, key_size, val_size, &m->ctrl, &m->keys, &m->vals))) {
+        allocs.free(allocs.ctx, m);
+        return NULL;
+    }
+    memset(m->ctrl, EMPTY, m->cap + GROUP_WIDTH);
     return m;
 }
 
-void sm_free(void *map, sm_allocator_t allocs) {
+int sm_free(void *map, sm_allocator_t allocs) {
     swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    int err = m->wal ? wal_release(m) : 0;
+    free(m->dirty);
     allocs.free(allocs.ctx, m->ctrl);
     allocs.free(allocs.ctx, m->keys);
     allocs.free(allocs.ctx, m->vals);
     allocs.free(allocs.ctx, m);
+    return err;
 }
 
 #ifdef __AVX2__
@@ -139,19 +231,51 @@ static inline uint32_t match(uint8_t h, const uint8_t *ctrl) {
 }
 #endif
 
-static void sm_grow(swiss_map_generic_t *m, uint64_t key_size, uint64_t val_size) {
+// Bit i set when ctrl[i] holds a key: EMPTY and DELETED are the only
+// bytes with the top bit set.
+#ifdef __AVX2__
+static inline uint64_t full_mask(const uint8_t *ctrl) {
+    return (uint32_t)~_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)ctrl));
+}
+#else
+static inline uint64_t full_mask(const uint8_t *ctrl) {
+    return ~_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl)) & 0xFFFFu;
+}
+#endif
+
+// The GROUP_WIDTH bytes past cap mirror the first slots so that a group load
+// near the end of ctrl sees the wrapped-around slots rather than stale EMPTYs.
+static inline void set_ctrl(swiss_map_generic_t *m, uint64_t pos, uint8_t c) {
+    m->ctrl[pos] = c;
+    if (pos < GROUP_WIDTH)
+        m->ctrl[m->cap + pos] = c;
+}
+
+// Moves every entry into fresh arrays of new_cap slots, dropping tombstones.
+// If an allocation fails (a bounded allocator such as a pfile's) the map is
+// left as it was and -1 returned with errno ENOMEM.
+static int sm_rehash(swiss_map_generic_t *m, uint64_t new_cap, uint64_t key_size, uint64_t val_size) {
+#ifdef SM_INSTRUMENT
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+#endif
+    uint8_t *ctrl;
+    void *keys, *vals;
+    if (unlikely(alloc_arrays(&m->alloc, new_cap, key_size, val_size, &ctrl, &keys, &vals)))
+        return -1;
     uint64_t old_cap = m->cap;
     uint8_t *old_ctrl = m->ctrl;
     void *old_keys = m->keys;
     void *old_vals = m->vals;
 
-    m->cap *= 2;
+    m->cap = new_cap;
     m->lgcap = __builtin_ctzll(m->cap);
     m->size = 0;
-    m->ctrl = m->alloc.alloc(m->alloc.ctx, m->cap + GROUP_SIZE);
-    memset(m->ctrl, EMPTY, m->cap + GROUP_SIZE);
-    m->keys = m->alloc.alloc(m->alloc.ctx, m->cap * key_size);
-    m->vals = m->alloc.alloc(m->alloc.ctx, m->cap * val_size);
+    m->tombstones = 0;
+    m->ctrl = ctrl;
+    memset(m->ctrl, EMPTY, m->cap + GROUP_WIDTH);
+    m->keys = keys;
+    m->vals = vals;
     for (uint64_t i = 0; likely(i < old_cap); i++) {
         uint8_t c = old_ctrl[i];
         if (c != EMPTY && c != DELETED) {
@@ -165,9 +289,10 @@ static void sm_grow(swiss_map_generic_t *m, uint64_t key_size, uint64_t val_size
                 if (likely(mask)) {
                     int j = __builtin_ctz(mask);
                     uint64_t pos = (idx + j) & (m->cap - 1);
-                    m->ctrl[pos] = h2;
+                    set_ctrl(m, pos, h2);
                     memcpy((char*)m->keys + pos * key_size, k_src, key_size);
                     memcpy((char*)m->vals + pos * val_size, v_src, val_size);
+                    SM_COUNT(m, bytes_copied, key_size + val_size);
                     m->size++;
                     break;
                 }
@@ -177,6 +302,37 @@ static void sm_grow(swiss_map_generic_t *m, uint64_t key_size, uint64_t val_size
     m->alloc.free(m->alloc.ctx, old_ctrl);
     m->alloc.free(m->alloc.ctx, old_keys);
     m->alloc.free(m->alloc.ctx, old_vals);
+    dirty_reset(m);
+#ifdef SM_INSTRUMENT
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    m->counters.grows++;
+    m->counters.grow_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ull + (t1.tv_nsec - t0.tv_nsec);
+#endif
+    return 0;
+}
+
+// Called when live slots plus tombstones reach the load limit. When most of
+// that is tombstones a rehash at the same capacity clears them, and doubling
+// would only spread the churn over more memory.
+static int sm_grow(swiss_map_generic_t *m, uint64_t key_size, uint64_t val_size) {
+    return sm_rehash(m, m->size * 5 >= m->cap * 2 ? m->cap * 2 : m->cap, key_size, val_size);
+}
+
+// Grows ahead of an insert that would pass the load limit; -1 if it could not.
+static inline int make_room(swiss_map_generic_t *m, uint64_t key_size, uint64_t val_size) {
+    if ((m->size + m->tombstones + 1) * 5 >= m->cap * 4)
+        return sm_grow(m, key_size, val_size);
+    return 0;
+}
+
+int sm_reserve(void *map, uint64_t n, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    // smallest cap for which sm_get's (size + 1) * 5 >= cap * 4 stays false
+    // up to size == n
+    uint64_t cap = next_pow2((n + 1) * 5 / 4 + 1);
+    if (cap > m->cap)
+        return sm_rehash(m, cap, key_size, val_size);
+    return 0;
 }
 
 void *sm_find(void *map, const void *key, uint64_t key_size, uint64_t val_size) {
@@ -185,52 +341,102 @@ void *sm_find(void *map, const void *key, uint64_t key_size, uint64_t val_size)
     uint8_t h2 = ((uint8_t)(h >> 56)) & 0x7F;
     uint64_t idx = index_for(h, m->lgcap);
     
-    for (;;) {
+    // Tombstones keep some groups free of EMPTY, so give up once every group
+    // has been seen, as probe_insert does.
+    for (uint64_t n = 0;; n++) {
         uint32_t mask = match(h2, &m->ctrl[idx]);
+        SM_COUNT(m, probes, 1);
+        SM_COUNT(m, h2_matches, __builtin_popcount(mask));
         while (mask) {
             int j = __builtin_ctz(mask);
             uint64_t pos = (idx + j) & (m->cap - 1);
+            SM_COUNT(m, memcmps, 1);
             if (memcmp((char*)m->keys + pos * key_size, key, key_size) == 0) {
                 return (char*)m->vals + pos * val_size;
             }
+            SM_COUNT(m, memcmp_misses, 1);
             mask &= mask - 1;
         }
-        if (match(EMPTY, &m->ctrl[idx])) return NULL;
+        if (match(EMPTY, &m->ctrl[idx]) || unlikely(n >= m->cap / GROUP_SIZE)) return NULL;
         idx = (idx + GROUP_SIZE) & (m->cap - 1);
     }
 }
 
-void *sm_get(void *map, const void *key, int *inserted, uint64_t key_size, uint64_t val_size) {
-    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
-    if ((m->size + 1) * 5 >= m->cap * 4)
-        sm_grow(m, key_size, val_size);
+// A contiguous key, for the probe helpers that take callbacks.
+typedef struct {
+    const void *key;
+    uint64_t len;
+} key_ref_t;
 
-    uint64_t h = m->alloc.hash(key, key_size);
+static inline int key_ref_eq(const void *key, void *ctx) {
+    const key_ref_t *r = ctx;
+    return !memcmp(key, r->key, r->len);
+}
+
+static inline void key_ref_copy(void *key, void *ctx) {
+    const key_ref_t *r = ctx;
+    memcpy(key, r->key, r->len);
+}
+
+// Returns the value slot for the key eq accepts, claiming the first free slot
+// on its probe sequence and filling it with copy if it is absent. The caller
+// has made room for one more entry. Returns NULL, with the map as it was, if
+// an attached log cannot record the put.
+static inline void *probe_insert_with(swiss_map_generic_t *m, uint64_t h, sm_eq_fn eq, sm_copy_fn copy, void *ctx, int *inserted, uint64_t key_size, uint64_t val_size) {
     uint8_t h2 = ((uint8_t)(h >> 56)) & 0x7F;
     uint64_t idx = index_for(h, m->lgcap); 
-    for (;; idx = (idx + GROUP_SIZE) & (m->cap-1)) {
+    uint64_t slot = m->cap;
+    for (uint64_t n = 0;; idx = (idx + GROUP_SIZE) & (m->cap-1)) {
         uint8_t *ctrl = m->ctrl + idx;
         __builtin_prefetch(ctrl + GROUP_SIZE, 0, 1);
-        uint32_t mask = match(h2, ctrl) | match(EMPTY, ctrl) | match(DELETED, ctrl);
-        while (likely(mask)) {
+        uint32_t mask = match(h2, ctrl);
+        SM_COUNT(m, probes, 1);
+        SM_COUNT(m, h2_matches, __builtin_popcount(mask));
+        while (mask) {
             int j = __builtin_ctz(mask);
             uint64_t pos = (idx + j) & (m->cap-1);
-            mask &= mask - 1;
-  
-            if (ctrl[j] == h2) {
-                if (!memcmp((char*)m->keys + pos*key_size, key, key_size)) {
-                    *inserted = 0;
-                    return (char*)m->vals + pos*val_size;
-                }
-            } else {
-                m->ctrl[pos] = h2;
-                memcpy((char*)m->keys + pos*key_size, key, key_size);
-                m->size++;
-                *inserted = 1;
+            SM_COUNT(m, memcmps, 1);
+            if (eq((char*)m->keys + pos*key_size, ctx)) {
+                if (unlikely(m->wal) && wal_log(m, WAL_PUT, pos, (char*)m->keys + pos*key_size))
+                    return NULL;
+                dirty_mark(m, pos);
+                *inserted = 0;
                 return (char*)m->vals + pos*val_size;
             }
+            SM_COUNT(m, memcmp_misses, 1);
+            mask &= mask - 1;
         }
+        uint32_t empty = match(EMPTY, ctrl);
+        uint32_t avail = empty | match(DELETED, ctrl);
+        if (slot == m->cap && avail)
+            slot = (idx + __builtin_ctz(avail)) & (m->cap-1);
+        if (likely(empty) || unlikely(++n > m->cap / GROUP_SIZE))
+            break;
     }
+    // the key goes in first so the log can copy it, but the slot is only
+    // claimed once the put is logged
+    copy((char*)m->keys + slot*key_size, ctx);
+    SM_COUNT(m, bytes_copied, key_size);
+    if (unlikely(m->wal) && wal_log(m, WAL_PUT, slot, (char*)m->keys + slot*key_size))
+        return NULL;
+    if (m->ctrl[slot] == DELETED) m->tombstones--;
+    set_ctrl(m, slot, h2);
+    dirty_mark(m, slot);
+    m->size++;
+    *inserted = 1;
+    return (char*)m->vals + slot*val_size;
+}
+
+static inline void *probe_insert(swiss_map_generic_t *m, uint64_t h, const void *key, int *inserted, uint64_t key_size, uint64_t val_size) {
+    key_ref_t r = { key, key_size };
+    return probe_insert_with(m, h, key_ref_eq, key_ref_copy, &r, inserted, key_size, val_size);
+}
+
+void *sm_get(void *map, const void *key, int *inserted, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    if (unlikely(make_room(m, key_size, val_size)))
+        return NULL;
+    return probe_insert(m, m->alloc.hash(key, key_size), key, inserted, key_size, val_size);
 }
 
 int sm_delete(void *map, const void *key, uint64_t key_size, uint64_t val_size) {
@@ -238,19 +444,1756 @@ int sm_delete(void *map, const void *key, uint64_t key_size, uint64_t val_size)
     uint64_t h = m->alloc.hash(key, key_size);
     uint8_t h2 = ((uint8_t)(h >> 56)) & 0x7F;
     uint64_t idx = index_for(h, m->lgcap);
-    for (;;) {
+    for (uint64_t n = 0;; n++) {
         uint32_t mask = match(h2, &m->ctrl[idx]);
+        SM_COUNT(m, probes, 1);
+        SM_COUNT(m, h2_matches, __builtin_popcount(mask));
         while (unlikely(mask)) {
             int j = __builtin_ctz(mask);
             uint64_t pos = (idx + j) & (m->cap - 1);
+            SM_COUNT(m, memcmps, 1);
             if (memcmp((char*)m->keys + pos*key_size, key, key_size) == 0) {
-                m->ctrl[pos] = DELETED;
+                if (unlikely(m->wal) && wal_log(m, WAL_DEL, pos, (char*)m->keys + pos*key_size))
+                    return -1;
+                set_ctrl(m, pos, DELETED);
+                m->tombstones++;
+                dirty_mark(m, pos);
                 m->size--;
                 return 0;
             }
+            SM_COUNT(m, memcmp_misses, 1);
             mask &= mask - 1;
         }
-        if (match(EMPTY, &m->ctrl[idx])) return -1;
+        if (match(EMPTY, &m->ctrl[idx]) || unlikely(n >= m->cap / GROUP_SIZE)) return -1;
         idx = (idx + GROUP_SIZE) & (m->cap - 1);
     }
 }
+
+// Pages lying wholly inside [p, p + len) go back to the kernel and read as
+// zeros on the next touch, which is fine for slots nothing reads before an
+// insert writes them.
+static void release_pages(void *p, uint64_t len) {
+    uint64_t pagesz = (uint64_t)sysconf(_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t)p + pagesz - 1) & ~(uintptr_t)(pagesz - 1);
+    uintptr_t hi = ((uintptr_t)p + len) & ~(uintptr_t)(pagesz - 1);
+    if (hi > lo)
+        madvise((void*)lo, hi - lo, MADV_DONTNEED);
+}
+
+int sm_clear(void *map, int flags, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    if (m->wal && wal_log(m, WAL_CLEAR, 0, NULL))
+        return -1;
+    uint64_t want = next_pow2(m->size + m->size / 4 + 1);
+    if (want < GROUP_WIDTH) want = GROUP_WIDTH;
+    m->size = 0;
+    m->tombstones = 0;
+
+    // if the smaller arrays cannot be had, clear at the current capacity
+    uint8_t *ctrl;
+    void *keys, *vals;
+    if ((flags & SM_CLEAR_SHRINK) && want * 4 <= m->cap
+        && !alloc_arrays(&m->alloc, want, key_size, val_size, &ctrl, &keys, &vals)) {
+        m->alloc.free(m->alloc.ctx, m->ctrl);
+        m->alloc.free(m->alloc.ctx, m->keys);
+        m->alloc.free(m->alloc.ctx, m->vals);
+        m->cap = want;
+        m->lgcap = __builtin_ctzll(m->cap);
+        m->ctrl = ctrl;
+        m->keys = keys;
+        m->vals = vals;
+        memset(m->ctrl, EMPTY, m->cap + GROUP_WIDTH);
+        dirty_reset(m);
+        return 0;
+    }
+    // ctrl has to be rewritten either way: a zeroed page would read as full
+    // slots with h2 == 0
+    memset(m->ctrl, EMPTY, m->cap + GROUP_WIDTH);
+    if (m->dirty) m->dirty->all = 1;
+    if (flags & SM_CLEAR_RELEASE) {
+        release_pages(m->keys, m->cap * key_size);
+        release_pages(m->vals, m->cap * val_size);
+    }
+    return 0;
+}
+
+// Above this a copy no longer fits in cache, and streaming stores keep it
+// from evicting the hot set and skip reading the destination lines first.
+#define SM_STREAM_MIN (8u << 20)
+
+static void copy_array(void *dst, const void *src, uint64_t n) {
+    if (n < SM_STREAM_MIN) {
+        memcpy(dst, src, n);
+        return;
+    }
+    char *d = dst;
+    const char *s = src;
+    uint64_t head = (16 - ((uintptr_t)d & 15)) & 15;
+    memcpy(d, s, head);
+    d += head, s += head, n -= head;
+    for (; n >= 64; d += 64, s += 64, n -= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)s);
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_stream_si128((__m128i*)d, a);
+        _mm_stream_si128((__m128i*)(d + 16), b);
+        _mm_stream_si128((__m128i*)(d + 32), c);
+        _mm_stream_si128((__m128i*)(d + 48), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+}
+
+static sm_allocator_t copy_allocator(const swiss_map_generic_t *m);
+
+void *sm_clone(void *map, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    sm_allocator_t a = copy_allocator(m);
+    swiss_map_generic_t *c = a.alloc(a.ctx, sizeof(*c));
+    if (unlikely(!c)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *c = *m;
+    c->alloc = a;
+    c->dirty = NULL;
+    c->wal = NULL;
+#ifdef SM_INSTRUMENT
+    memset(&c->counters, 0, sizeof(c->counters));
+#endif
+    if (unlikely(alloc_arrays(&a, m->cap, key_size, val_size, &c->ctrl, &c->keys, &c->vals))) {
+        a.free(a.ctx, c);
+        return NULL;
+    }
+    copy_array(c->ctrl, m->ctrl, m->cap + GROUP_WIDTH);
+    copy_array(c->keys, m->keys, m->cap * key_size);
+    copy_array(c->vals, m->vals, m->cap * val_size);
+    return c;
+}
+
+uint64_t sm_merge(void *dst, void *src, int policy, sm_combine_fn combine, void *ctx, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *d = (swiss_map_generic_t*)dst;
+    swiss_map_generic_t *s = (swiss_map_generic_t*)src;
+    sm_reserve(d, d->size + s->size, key_size, val_size);
+
+    // Hashes are not stored, so each 64-slot window of src is hashed first
+    // and the home groups prefetched, giving the loads time to land before
+    // the inserts walk them in the second pass.
+    uint64_t hashes[64], added = 0;
+    sm_iter_t it;
+    sm_iter_begin(s, &it, key_size, val_size);
+    while (sm_iter_refill(&it)) {
+        uint64_t n = 0;
+        for (uint64_t mask = it.mask; mask; mask &= mask - 1, n++) {
+            uint64_t i = it.base + __builtin_ctzll(mask);
+            hashes[n] = d->alloc.hash(it.keys + i * key_size, key_size);
+            uint64_t idx = index_for(hashes[n], d->lgcap);
+            __builtin_prefetch(&d->ctrl[idx], 0, 1);
+            __builtin_prefetch((char*)d->keys + idx * key_size, 0, 1);
+        }
+        n = 0;
+        for (uint64_t mask = it.mask; mask; mask &= mask - 1, n++) {
+            uint64_t i = it.base + __builtin_ctzll(mask);
+            const char *k = it.keys + i * key_size, *v = it.vals + i * val_size;
+            int inserted;
+            // only fails if the reserve above could not allocate either
+            if (unlikely(make_room(d, key_size, val_size)))
+                return added;
+            void *slot = probe_insert(d, hashes[n], k, &inserted, key_size, val_size);
+            if (unlikely(!slot))
+                return added;
+            if (inserted) {
+                memcpy(slot, v, val_size);
+                added++;
+            } else if (policy == SM_MERGE_OVERWRITE) {
+                memcpy(slot, v, val_size);
+            } else if (policy == SM_MERGE_COMBINE) {
+                combine(slot, v, k, ctx);
+            }
+        }
+        it.mask = 0;
+    }
+    return added;
+}
+void sm_stats(void *map, sm_stats_t *out, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    memset(out, 0, sizeof(*out));
+    out->size = m->size;
+    out->cap = m->cap;
+    out->load = (double)m->size / (double)m->cap;
+    out->ctrl_bytes = m->cap + GROUP_WIDTH;
+    out->key_bytes = m->cap * key_size;
+    out->val_bytes = m->cap * val_size;
+
+    uint64_t probes = 0, false_pos = 0;
+    for (uint64_t i = 0; i < m->cap; i++) {
+        uint8_t c = m->ctrl[i];
+        if (c == DELETED) out->tombstones++;
+        if (c & 0x80) continue;
+
+        // replay the sm_find probe sequence that ends at slot i
+        uint64_t h = m->alloc.hash((char*)m->keys + i * key_size, key_size);
+        uint64_t idx = index_for(h, m->lgcap);
+        uint64_t n = 1;
+        for (;; n++, idx = (idx + GROUP_SIZE) & (m->cap - 1)) {
+            uint32_t mask = match(c, &m->ctrl[idx]);
+            uint32_t hit = 0;
+            while (mask) {
+                int j = __builtin_ctz(mask);
+                if (((idx + j) & (m->cap - 1)) == i) { hit = 1; break; }
+                false_pos++;
+                mask &= mask - 1;
+            }
+            if (hit) break;
+        }
+        probes += n;
+        if (n > out->max_probe) out->max_probe = n;
+        out->probe_hist[n < SM_PROBE_HIST ? n - 1 : SM_PROBE_HIST - 1]++;
+    }
+    if (m->size) {
+        out->avg_probe = (double)probes / (double)m->size;
+        out->h2_false_positives = (double)false_pos / (double)m->size;
+    }
+}
+
+sm_counters_t *sm_counters(void *map) {
+#ifdef SM_INSTRUMENT
+    return &((swiss_map_generic_t*)map)->counters;
+#else
+    (void)map;
+    return NULL;
+#endif
+}
+
+void sm_iter_begin(void *map, sm_iter_t *it, uint64_t key_size, uint64_t val_size) {
+    sm_iter_chunk(map, it, 0, 1, key_size, val_size);
+}
+
+void sm_iter_chunk(void *map, sm_iter_t *it, uint64_t chunk, uint64_t nchunks, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    uint64_t windows = (m->cap + 63) / 64;
+    uint64_t per = (windows + nchunks - 1) / nchunks * 64;
+    uint64_t lo = chunk * per, hi = lo + per;
+    it->ctrl = m->ctrl;
+    it->keys = m->keys;
+    it->vals = m->vals;
+    it->key_size = key_size;
+    it->val_size = val_size;
+    it->end = hi < m->cap ? hi : m->cap;
+    it->base = lo;
+    it->next = lo;
+    it->mask = 0;
+}
+
+// cap is a power of two no smaller than GROUP_WIDTH and chunks start on
+// 64-slot boundaries, so the windows tile ctrl exactly and never read the
+// mirrored tail.
+int sm_iter_refill(sm_iter_t *it) {
+    while (it->next < it->end) {
+        uint64_t n = it->end - it->next < 64 ? it->end - it->next : 64;
+        uint64_t full = 0;
+        for (uint64_t i = 0; i < n; i += GROUP_WIDTH)
+            full |= full_mask(&it->ctrl[it->next + i]) << i;
+        it->base = it->next;
+        it->next += n;
+        if (full) {
+            it->mask = full;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    void *map;
+    sm_visit_fn fn;
+    void *ctx;
+    uint64_t chunk, nchunks, key_size, val_size;
+} sm_chunk_job_t;
+
+static void *sm_chunk_run(void *arg) {
+    sm_chunk_job_t *j = arg;
+    sm_iter_t it;
+    void *k, *v;
+    sm_iter_chunk(j->map, &it, j->chunk, j->nchunks, j->key_size, j->val_size);
+    while (sm_iter_next(&it, &k, &v))
+        j->fn(k, v, j->chunk, j->ctx);
+    return NULL;
+}
+
+void sm_for_each_parallel(void *map, uint64_t nthreads, sm_visit_fn fn, void *ctx, uint64_t key_size, uint64_t val_size) {
+    if (nthreads < 1) nthreads = 1;
+    pthread_t *tids = malloc(nthreads * sizeof(*tids));
+    sm_chunk_job_t *jobs = malloc(nthreads * sizeof(*jobs));
+    uint8_t *started = calloc(nthreads, 1);
+    if (unlikely(!tids || !jobs || !started)) {
+        // no room for the bookkeeping: walk it on this thread instead
+        sm_chunk_job_t j = { map, fn, ctx, 0, 1, key_size, val_size };
+        sm_chunk_run(&j);
+        free(tids);
+        free(jobs);
+        free(started);
+        return;
+    }
+    for (uint64_t i = 0; i < nthreads; i++)
+        jobs[i] = (sm_chunk_job_t){ map, fn, ctx, i, nthreads, key_size, val_size };
+    // chunk 0 runs on the calling thread, as does any chunk whose thread
+    // could not be created
+    for (uint64_t i = 1; i < nthreads; i++)
+        started[i] = pthread_create(&tids[i], NULL, sm_chunk_run, &jobs[i]) == 0;
+    sm_chunk_run(&jobs[0]);
+    for (uint64_t i = 1; i < nthreads; i++) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        else sm_chunk_run(&jobs[i]);
+    }
+    free(tids);
+    free(jobs);
+    free(started);
+}
+
+int sm_slices_eq(const void *key, void *ctx) {
+    const sm_slices_t *s = ctx;
+    const char *k = key;
+    for (uint64_t i = 0; i < s->n; i++) {
+        if (memcmp(k, s->v[i].data, s->v[i].len)) return 0;
+        k += s->v[i].len;
+    }
+    return 1;
+}
+
+void sm_slices_copy(void *key, void *ctx) {
+    const sm_slices_t *s = ctx;
+    char *k = key;
+    for (uint64_t i = 0; i < s->n; i++) {
+        memcpy(k, s->v[i].data, s->v[i].len);
+        k += s->v[i].len;
+    }
+}
+
+void *sm_find_hashed(void *map, uint64_t h, sm_eq_fn eq, void *ctx, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    uint8_t h2 = ((uint8_t)(h >> 56)) & 0x7F;
+    uint64_t idx = index_for(h, m->lgcap);
+
+    for (uint64_t n = 0;; n++) {
+        uint32_t mask = match(h2, &m->ctrl[idx]);
+        SM_COUNT(m, probes, 1);
+        SM_COUNT(m, h2_matches, __builtin_popcount(mask));
+        while (mask) {
+            int j = __builtin_ctz(mask);
+            uint64_t pos = (idx + j) & (m->cap - 1);
+            SM_COUNT(m, memcmps, 1);
+            if (eq((char*)m->keys + pos * key_size, ctx)) {
+                return (char*)m->vals + pos * val_size;
+            }
+            SM_COUNT(m, memcmp_misses, 1);
+            mask &= mask - 1;
+        }
+        if (match(EMPTY, &m->ctrl[idx]) || unlikely(n >= m->cap / GROUP_SIZE)) return NULL;
+        idx = (idx + GROUP_SIZE) & (m->cap - 1);
+    }
+}
+
+void *sm_get_hashed(void *map, uint64_t h, sm_eq_fn eq, sm_copy_fn copy, void *ctx, int *inserted, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    if (unlikely(make_room(m, key_size, val_size)))
+        return NULL;
+    return probe_insert_with(m, h, eq, copy, ctx, inserted, key_size, val_size);
+}
+
+int sm_delete_hashed(void *map, uint64_t h, sm_eq_fn eq, void *ctx, uint64_t key_size, uint64_t val_size) {
+    (void)val_size;
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    uint8_t h2 = ((uint8_t)(h >> 56)) & 0x7F;
+    uint64_t idx = index_for(h, m->lgcap);
+    for (uint64_t n = 0;; n++) {
+        uint32_t mask = match(h2, &m->ctrl[idx]);
+        SM_COUNT(m, probes, 1);
+        SM_COUNT(m, h2_matches, __builtin_popcount(mask));
+        while (unlikely(mask)) {
+            int j = __builtin_ctz(mask);
+            uint64_t pos = (idx + j) & (m->cap - 1);
+            SM_COUNT(m, memcmps, 1);
+            if (eq((char*)m->keys + pos*key_size, ctx)) {
+                if (unlikely(m->wal) && wal_log(m, WAL_DEL, pos, (char*)m->keys + pos*key_size))
+                    return -1;
+                set_ctrl(m, pos, DELETED);
+                m->tombstones++;
+                dirty_mark(m, pos);
+                m->size--;
+                return 0;
+            }
+            SM_COUNT(m, memcmp_misses, 1);
+            mask &= mask - 1;
+        }
+        if (match(EMPTY, &m->ctrl[idx]) || unlikely(n >= m->cap / GROUP_SIZE)) return -1;
+        idx = (idx + GROUP_SIZE) & (m->cap - 1);
+    }
+}
+
+// Snapshot file: one header page, then ctrl (with its mirrored tail), keys
+// and vals, each starting on a SM_FILE_ALIGN boundary so the arrays can be
+// used in place from a mapping of the whole file. Integers are native endian.
+#define SM_FILE_MAGIC   "SWISSMAP"
+#define SM_FILE_VERSION 2
+#define SM_FILE_ALIGN   4096ull
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t group_width;
+    uint64_t cap, lgcap, size;
+    uint64_t key_size, val_size;
+    uint64_t hash_id;
+    uint64_t seed; // reserved: the hash functions in use are unseeded
+    uint64_t ctrl_off, keys_off, vals_off, file_size;
+    uint64_t flags; // reserved, 0
+    uint64_t tombstones;
+    uint64_t snap_id; // names this snapshot for the deltas written against it
+} sm_file_header_t;
+
+// Checkpoint delta, kept beside the snapshot as path.delta: the regions that
+// changed since the snapshot snap_id was saved, as runs of
+//   uint64_t lo, hi; ctrl, keys and vals of slots [lo, hi)
+// after the header. A checkpoint replaces the whole file by renaming, so the
+// snapshot and whichever delta is on disk always agree.
+#define SM_DELTA_MAGIC   "SWISSDLT"
+#define SM_DELTA_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t group_width;
+    uint64_t base_id;
+    uint64_t cap, size, tombstones;
+    uint64_t key_size, val_size;
+    uint64_t runs;
+} sm_delta_header_t;
+
+static inline uint64_t file_align(uint64_t x) {
+    return (x + SM_FILE_ALIGN - 1) & ~(SM_FILE_ALIGN - 1);
+}
+
+static void file_layout(sm_file_header_t *h) {
+    h->ctrl_off = SM_FILE_ALIGN;
+    h->keys_off = file_align(h->ctrl_off + h->cap + h->group_width);
+    h->vals_off = file_align(h->keys_off + h->cap * h->key_size);
+    h->file_size = file_align(h->vals_off + h->cap * h->val_size);
+}
+
+static int read_all(int fd, void *p, uint64_t n, uint64_t off) {
+    char *c = p;
+    while (n) {
+        ssize_t r = pread(fd, c, n, (off_t)off);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            if (!r) errno = EINVAL;
+            return -1;
+        }
+        c += r, off += (uint64_t)r, n -= (uint64_t)r;
+    }
+    return 0;
+}
+
+// path with suffix appended, malloc'd
+static char *path_with(const char *path, const char *suffix) {
+    size_t plen = strlen(path), slen = strlen(suffix);
+    char *p = malloc(plen + slen + 1);
+    if (!p) return NULL;
+    memcpy(p, path, plen);
+    memcpy(p + plen, suffix, slen + 1);
+    return p;
+}
+
+// Unique enough to tell apart two snapshots written to one path.
+static uint64_t snapshot_id(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec) ^ ((uint64_t)getpid() << 48);
+}
+
+static int write_all(int fd, const void *p, uint64_t n, uint64_t off) {
+    const char *c = p;
+    while (n) {
+        ssize_t w = pwrite(fd, c, n, (off_t)off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        c += w, off += (uint64_t)w, n -= (uint64_t)w;
+    }
+    return 0;
+}
+
+static int save_snapshot(swiss_map_generic_t *m, const char *path, uint64_t hash_id, uint64_t id, uint64_t key_size, uint64_t val_size) {
+    sm_file_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SM_FILE_MAGIC, sizeof(h.magic));
+    h.version = SM_FILE_VERSION;
+    h.group_width = GROUP_WIDTH;
+    h.cap = m->cap;
+    h.lgcap = m->lgcap;
+    h.size = m->size;
+    h.tombstones = m->tombstones;
+    h.key_size = key_size;
+    h.val_size = val_size;
+    h.hash_id = hash_id;
+    h.snap_id = id;
+    file_layout(&h);
+
+    // written beside the target and renamed over it, so a reader never maps
+    // a half-written snapshot
+    char *tmp = path_with(path, ".tmp");
+    if (!tmp) return -1;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+    int err = ftruncate(fd, (off_t)h.file_size)
+        || write_all(fd, &h, sizeof(h), 0)
+        || write_all(fd, m->ctrl, m->cap + GROUP_WIDTH, h.ctrl_off)
+        || write_all(fd, m->keys, m->cap * key_size, h.keys_off)
+        || write_all(fd, m->vals, m->cap * val_size, h.vals_off)
+        || fsync(fd);
+    err = close(fd) || err;
+    if (!err) err = rename(tmp, path);
+    if (err) unlink(tmp);
+    free(tmp);
+    if (err) return -1;
+    // a delta against the snapshot just replaced no longer applies
+    char *delta = path_with(path, ".delta");
+    if (delta) unlink(delta);
+    free(delta);
+    return 0;
+}
+
+int sm_save(void *map, const char *path, uint64_t hash_id, uint64_t key_size, uint64_t val_size) {
+    return save_snapshot(map, path, hash_id, snapshot_id(), key_size, val_size);
+}
+
+int sm_track_dirty(void *map, uint64_t region_slots) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    free(m->dirty);
+    m->dirty = NULL;
+    if (!region_slots) return 0;
+    uint64_t shift = 0;
+    while ((1ull << shift) < region_slots)
+        shift++;
+    m->dirty = dirty_new(m->cap, shift);
+    return m->dirty ? 0 : -1;
+}
+
+// Writes the dirty regions as path.delta, through a temporary file and a
+// rename like sm_save.
+static int write_delta(swiss_map_generic_t *m, const char *path, uint64_t base_id, uint64_t regions, uint64_t key_size, uint64_t val_size) {
+    sm_dirty_t *d = m->dirty;
+    sm_delta_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SM_DELTA_MAGIC, sizeof(h.magic));
+    h.version = SM_DELTA_VERSION;
+    h.group_width = GROUP_WIDTH;
+    h.base_id = base_id;
+    h.cap = m->cap;
+    h.size = m->size;
+    h.tombstones = m->tombstones;
+    h.key_size = key_size;
+    h.val_size = val_size;
+
+    char *delta = path_with(path, ".delta"), *tmp = path_with(path, ".delta.tmp");
+    int fd = delta && tmp ? open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd < 0) {
+        free(delta);
+        free(tmp);
+        return -1;
+    }
+    int err = 0;
+    uint64_t off = sizeof(h);
+    for (uint64_t r = 0; !err && r < regions;) {
+        if (!(d->bits[r >> 6] >> (r & 63) & 1)) {
+            r++;
+            continue;
+        }
+        // coalesce a run of dirty regions into one record
+        uint64_t e = r + 1;
+        while (e < regions && (d->bits[e >> 6] >> (e & 63) & 1))
+            e++;
+        uint64_t lo = r << d->shift, hi = e << d->shift;
+        if (hi > m->cap) hi = m->cap;
+        uint64_t run[2] = { lo, hi }, n = hi - lo;
+        err = write_all(fd, run, sizeof(run), off)
+            || write_all(fd, m->ctrl + lo, n, off + sizeof(run))
+            || write_all(fd, (char*)m->keys + lo * key_size, n * key_size, off + sizeof(run) + n)
+            || write_all(fd, (char*)m->vals + lo * val_size, n * val_size, off + sizeof(run) + n * (1 + key_size));
+        off += sizeof(run) + n * (1 + key_size + val_size);
+        h.runs++;
+        r = e;
+    }
+    if (!err) err = write_all(fd, &h, sizeof(h), 0) || fsync(fd);
+    err = close(fd) || err;
+    if (!err) err = rename(tmp, delta);
+    if (err) unlink(tmp);
+    free(delta);
+    free(tmp);
+    return err ? -1 : 0;
+}
+
+// Applies path.delta to a snapshot just mapped at base, updating h's counts.
+// A missing delta, or one written against another snapshot, is skipped.
+static int apply_delta(const char *path, sm_file_header_t *h, char *base) {
+    char *delta = path_with(path, ".delta");
+    if (!delta) return -1;
+    int fd = open(delta, O_RDONLY);
+    free(delta);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    sm_delta_header_t d;
+    struct stat st;
+    int err = fstat(fd, &st) || read_all(fd, &d, sizeof(d), 0);
+    if (err || memcmp(d.magic, SM_DELTA_MAGIC, sizeof(d.magic)) || d.version != SM_DELTA_VERSION
+        || d.base_id != h->snap_id) {
+        close(fd);
+        return err ? -1 : 0;
+    }
+    if (d.group_width != h->group_width || d.cap != h->cap || d.key_size != h->key_size
+        || d.val_size != h->val_size || d.size >= d.cap || d.tombstones > d.cap - d.size) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t ks = h->key_size, vs = h->val_size, off = sizeof(d);
+    for (uint64_t i = 0; !err && i < d.runs; i++) {
+        uint64_t run[2];
+        if ((err = read_all(fd, run, sizeof(run), off)))
+            break;
+        uint64_t lo = run[0], hi = run[1], n = hi - lo;
+        if (lo >= hi || hi > h->cap || n * (1 + ks + vs) > (uint64_t)st.st_size - off - sizeof(run)) {
+            errno = EINVAL;
+            err = -1;
+            break;
+        }
+        err = read_all(fd, base + h->ctrl_off + lo, n, off + sizeof(run))
+            || read_all(fd, base + h->keys_off + lo * ks, n * ks, off + sizeof(run) + n)
+            || read_all(fd, base + h->vals_off + lo * vs, n * vs, off + sizeof(run) + n * (1 + ks));
+        off += sizeof(run) + n * (1 + ks + vs);
+    }
+    close(fd);
+    if (err) return -1;
+    memcpy(base + h->ctrl_off + h->cap, base + h->ctrl_off, h->group_width);
+    h->size = d.size;
+    h->tombstones = d.tombstones;
+    return 0;
+}
+
+int sm_checkpoint(void *map, const char *path, uint64_t hash_id, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    sm_dirty_t *d = m->dirty;
+    if (!d || d->all) goto full;
+
+    // The snapshot itself is only ever replaced whole; the regions changed
+    // since it was saved go to a delta beside it. Once they are more than
+    // half the table a fresh snapshot is cheaper than the delta.
+    uint64_t regions = (m->cap >> d->shift) ? m->cap >> d->shift : 1, dirty = 0;
+    for (uint64_t w = 0; w < (regions + 63) / 64; w++)
+        dirty += __builtin_popcountll(d->bits[w]);
+    if (dirty * 2 > regions) goto full;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) goto full;
+    sm_file_header_t h;
+    int ok = read_all(fd, &h, sizeof(h), 0) == 0
+        && !memcmp(h.magic, SM_FILE_MAGIC, sizeof(h.magic)) && h.version == SM_FILE_VERSION
+        && h.group_width == GROUP_WIDTH && h.hash_id == hash_id && h.cap == m->cap
+        && h.key_size == key_size && h.val_size == val_size && h.snap_id == d->base_id;
+    close(fd);
+    if (!ok) goto full;
+    return write_delta(m, path, d->base_id, regions, key_size, val_size);
+
+full:;
+    uint64_t id = snapshot_id();
+    if (save_snapshot(m, path, hash_id, id, key_size, val_size)) return -1;
+    if (d) {
+        d->all = 0;
+        d->base_id = id;
+        memset(d->bits, 0, ((m->cap >> d->shift ? m->cap >> d->shift : 1) + 63) / 64 * sizeof(uint64_t));
+    }
+    return 0;
+}
+
+// Allocator wrapped around a map opened from a snapshot. Its arrays live in
+// the file mapping until a grow replaces them; free ignores pointers into
+// the mapping, unmaps it once none of the three arrays use it any more, and
+// releases this context together with the map struct.
+typedef struct {
+    sm_allocator_t inner;
+    void *base;
+    uint64_t len;
+    int mapped_arrays;
+    void *map;
+} sm_file_ctx_t;
+
+static void *file_alloc(void *ctx, uint64_t n) {
+    sm_file_ctx_t *f = ctx;
+    return f->inner.alloc(f->inner.ctx, n);
+}
+
+static void file_free(void *ctx, void *p) {
+    sm_file_ctx_t *f = ctx;
+    if (f->base && (char*)p >= (char*)f->base && (char*)p < (char*)f->base + f->len) {
+        if (--f->mapped_arrays == 0) {
+            munmap(f->base, f->len);
+            f->base = NULL;
+        }
+        return;
+    }
+    sm_allocator_t inner = f->inner;
+    if (p == f->map) {
+        if (f->base) munmap(f->base, f->len);
+        inner.free(inner.ctx, f);
+    }
+    inner.free(inner.ctx, p);
+}
+
+// The allocator for a copy of m. A map from sm_open allocates through a
+// context that dies with it, so its copies use the allocator behind it.
+static sm_allocator_t copy_allocator(const swiss_map_generic_t *m) {
+    if (m->alloc.alloc != file_alloc)
+        return m->alloc;
+    sm_allocator_t a = ((sm_file_ctx_t*)m->alloc.ctx)->inner;
+    a.hash = m->alloc.hash;
+    return a;
+}
+
+void *sm_open(const char *path, sm_allocator_t allocs, uint64_t hash_id, int flags, uint64_t key_size, uint64_t val_size) {
+    if (allocs.alloc == NULL || allocs.free == NULL) {
+        allocs.ctx = NULL;
+        allocs.alloc = sm_alloc;
+        allocs.free = sm_unalloc;
+    }
+    if (allocs.hash == NULL)
+        allocs.hash = fnv1a;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    sm_file_header_t h, want;
+    if (fstat(fd, &st) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+        close(fd);
+        return NULL;
+    }
+    want = h;
+    file_layout(&want);
+    if (memcmp(h.magic, SM_FILE_MAGIC, sizeof(h.magic)) || h.version != SM_FILE_VERSION
+        || h.group_width != GROUP_WIDTH || h.hash_id != hash_id
+        || h.key_size != key_size || h.val_size != val_size
+        || h.cap < GROUP_WIDTH || (h.cap & (h.cap - 1)) || h.lgcap != (uint64_t)__builtin_ctzll(h.cap)
+        || h.size >= h.cap || h.tombstones > h.cap - h.size || memcmp(&h, &want, sizeof(h))
+        || (uint64_t)st.st_size < h.file_size) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // writable at first even for SM_OPEN_READONLY, for the delta; the
+    // mapping is private, so nothing reaches the file either way
+    void *base = mmap(NULL, h.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+    if (apply_delta(path, &h, base)
+        || ((flags & SM_OPEN_READONLY) && mprotect(base, h.file_size, PROT_READ))) {
+        int e = errno;
+        munmap(base, h.file_size);
+        errno = e;
+        return NULL;
+    }
+
+    sm_file_ctx_t *f = allocs.alloc(allocs.ctx, sizeof(*f));
+    swiss_map_generic_t *m = allocs.alloc(allocs.ctx, sizeof(*m));
+    f->inner = allocs;
+    f->base = base;
+    f->len = h.file_size;
+    f->mapped_arrays = 3;
+    f->map = m;
+
+    m->alloc.ctx = f;
+    m->alloc.alloc = file_alloc;
+    m->alloc.free = file_free;
+    m->alloc.hash = allocs.hash;
+    m->ctrl = (uint8_t*)base + h.ctrl_off;
+    m->keys = (char*)base + h.keys_off;
+    m->vals = (char*)base + h.vals_off;
+    m->cap = h.cap;
+    m->lgcap = h.lgcap;
+    m->size = h.size;
+    m->tombstones = h.tombstones;
+    m->dirty = NULL;
+    m->wal = NULL;
+#ifdef SM_INSTRUMENT
+    memset(&m->counters, 0, sizeof(m->counters));
+#endif
+    return m;
+}
+
+// Persistent map file: a header page, then blocks handed out by a bump
+// pointer and a first-fit free list. Every link is a file offset; the only
+// absolute pointers are the three array pointers in the map struct, which
+// are relocated by (new base - base_addr) when the file is opened at a
+// different address.
+#define SM_PFILE_MAGIC   "SWISSPF"
+#define SM_PFILE_VERSION 4
+#define SM_PFILE_BLOCK   16ull // block header: payload size, next free block
+#define SM_PFILE_ALIGN   64ull
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t group_width;
+    uint64_t base_addr; // where the map struct's pointers assume the file is
+    uint64_t size;      // file size, all of it mapped
+    uint64_t bump;      // offset of the first never allocated byte
+    uint64_t free_head; // offset of the first free block, 0 for none
+    uint64_t root;      // offset of the map struct, 0 before sm_pfile_map
+    uint64_t hash_id, key_size, val_size;
+} sm_pfile_header_t;
+
+struct sm_pfile {
+    int fd;
+    char *base;
+    uint64_t reserved;
+    sm_pfile_header_t *h;
+};
+
+// Grows the file and the shared mapping inside the reserved range; the base
+// address never changes while the file is open.
+static int pfile_extend(sm_pfile_t *f, uint64_t need) {
+    uint64_t old = f->h->size, size = old;
+    while (size < need) size *= 2;
+    size = file_align(size);
+    // the last doubling may overshoot a reservation that still fits need
+    if (size > f->reserved && need <= f->reserved)
+        size = f->reserved;
+    if (size > f->reserved || ftruncate(f->fd, (off_t)size))
+        return -1;
+    if (mmap(f->base + old, size - old, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             f->fd, (off_t)old) == MAP_FAILED)
+        return -1;
+    f->h->size = size;
+    return 0;
+}
+
+static void *pfile_alloc(void *ctx, uint64_t n) {
+    sm_pfile_t *f = ctx;
+    n = (n + SM_PFILE_ALIGN - 1) & ~(SM_PFILE_ALIGN - 1);
+    for (uint64_t *link = &f->h->free_head; *link; link = (uint64_t*)(f->base + *link) + 1) {
+        uint64_t *blk = (uint64_t*)(f->base + *link);
+        if (blk[0] >= n) {
+            void *p = (char*)blk + SM_PFILE_BLOCK;
+            *link = blk[1];
+            return p;
+        }
+    }
+    uint64_t off = f->h->bump, end = off + SM_PFILE_BLOCK + n;
+    end = (end + SM_PFILE_ALIGN - 1) & ~(SM_PFILE_ALIGN - 1);
+    if (end > f->h->size && pfile_extend(f, end))
+        return NULL;
+    uint64_t *blk = (uint64_t*)(f->base + off);
+    blk[0] = end - off - SM_PFILE_BLOCK;
+    blk[1] = 0;
+    f->h->bump = end;
+    return (char*)blk + SM_PFILE_BLOCK;
+}
+
+static void pfile_free(void *ctx, void *p) {
+    sm_pfile_t *f = ctx;
+    if (!p) return;
+    uint64_t off = (uint64_t)((char*)p - f->base) - SM_PFILE_BLOCK;
+    if (off + SM_PFILE_BLOCK == f->h->root)
+        f->h->root = 0;
+    uint64_t *blk = (uint64_t*)(f->base + off);
+    blk[1] = f->h->free_head;
+    f->h->free_head = off;
+}
+
+sm_pfile_t *sm_pfile_open(const char *path, uint64_t max_size) {
+    sm_pfile_t *f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    f->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (f->fd < 0) goto fail;
+    if (flock(f->fd, LOCK_EX | LOCK_NB)) goto fail;
+
+    struct stat st;
+    sm_pfile_header_t h;
+    if (fstat(f->fd, &st)) goto fail;
+    int fresh = st.st_size == 0;
+    if (fresh) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, SM_PFILE_MAGIC, sizeof(h.magic));
+        h.version = SM_PFILE_VERSION;
+        h.group_width = GROUP_WIDTH;
+        h.size = 16 * SM_FILE_ALIGN;
+        h.bump = SM_FILE_ALIGN;
+        if (ftruncate(f->fd, (off_t)h.size) || write_all(f->fd, &h, sizeof(h), 0)) goto fail;
+    } else if (pread(f->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)
+               || memcmp(h.magic, SM_PFILE_MAGIC, sizeof(h.magic)) || h.version != SM_PFILE_VERSION
+               || h.group_width != GROUP_WIDTH || h.size != (uint64_t)st.st_size) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    // reserve the whole range up front so extending never moves the base
+    f->reserved = file_align(max_size > h.size ? max_size : h.size);
+    f->base = mmap(NULL, f->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (f->base == MAP_FAILED) {
+        f->base = NULL;
+        goto fail;
+    }
+    if (mmap(f->base, h.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, f->fd, 0) == MAP_FAILED)
+        goto fail;
+    f->h = (sm_pfile_header_t*)f->base;
+
+    if (f->h->root) {
+        swiss_map_generic_t *m = (swiss_map_generic_t*)(f->base + f->h->root);
+        uintptr_t delta = (uintptr_t)f->base - (uintptr_t)f->h->base_addr;
+        m->ctrl = (uint8_t*)((uintptr_t)m->ctrl + delta);
+        m->keys = (void*)((uintptr_t)m->keys + delta);
+        m->vals = (void*)((uintptr_t)m->vals + delta);
+    }
+    f->h->base_addr = (uint64_t)(uintptr_t)f->base;
+    return f;
+
+fail:
+    if (f->base) munmap(f->base, f->reserved);
+    if (f->fd >= 0) close(f->fd);
+    free(f);
+    return NULL;
+}
+
+sm_allocator_t sm_pfile_allocator(sm_pfile_t *f, sm_hash_fn hash) {
+    sm_allocator_t a;
+    a.ctx = f;
+    a.alloc = pfile_alloc;
+    a.free = pfile_free;
+    a.hash = hash ? hash : fnv1a;
+    return a;
+}
+
+void *sm_pfile_map(sm_pfile_t *f, uint64_t init_cap, sm_hash_fn hash, uint64_t hash_id, uint64_t key_size, uint64_t val_size) {
+    sm_pfile_header_t *h = f->h;
+    if (h->root) {
+        if (h->hash_id != hash_id || h->key_size != key_size || h->val_size != val_size) {
+            errno = EINVAL;
+            return NULL;
+        }
+        // function pointers do not survive a restart; reattach them
+        swiss_map_generic_t *m = (swiss_map_generic_t*)(f->base + h->root);
+        m->alloc = sm_pfile_allocator(f, hash);
+        m->dirty = NULL;
+        m->wal = NULL;
+        return m;
+    }
+    void *m = sm_new(init_cap, key_size, val_size, sm_pfile_allocator(f, hash));
+    if (!m) return NULL;
+    h->root = (uint64_t)((char*)m - f->base);
+    h->hash_id = hash_id;
+    h->key_size = key_size;
+    h->val_size = val_size;
+    return m;
+}
+
+int sm_pfile_sync(sm_pfile_t *f) {
+    return msync(f->base, f->h->size, MS_SYNC);
+}
+
+int sm_pfile_close(sm_pfile_t *f) {
+    int err = sm_pfile_sync(f);
+    munmap(f->base, f->reserved);
+    err = close(f->fd) || err;
+    free(f);
+    return err ? -1 : 0;
+}
+
+// Shared memory map: the header and arrays sit in one region (shm_open,
+// memfd_create, or any file) that each process maps wherever it likes, so
+// the header holds offsets and every process keeps its own view struct with
+// pointers into its mapping for the ordinary probing code. The capacity is
+// fixed at creation since a grow would have to remap every process.
+// One process writes, under a sequence lock: seq is odd while an update is
+// in progress, and readers retry any lookup that saw it change.
+#define SM_SHM_MAGIC   "SWISSSHM"
+#define SM_SHM_VERSION 3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t group_width;
+    _Atomic uint64_t seq;
+    uint64_t cap, lgcap, size, tombstones, max_entries;
+    uint64_t key_size, val_size, hash_id;
+    uint64_t ctrl_off, keys_off, vals_off, region_size;
+} sm_shm_header_t;
+
+struct sm_shm {
+    sm_shm_header_t *h;
+    swiss_map_generic_t view;
+    uint64_t key_size, val_size;
+    int writable;
+};
+
+static sm_shm_t *shm_map(int fd, uint64_t region_size, int writable, sm_hash_fn hash) {
+    sm_shm_t *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *base = mmap(NULL, region_size, prot, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(s);
+        return NULL;
+    }
+    s->h = base;
+    s->writable = writable;
+    s->view.alloc = sm_mmap_allocator();
+    if (hash) s->view.alloc.hash = hash;
+    return s;
+}
+
+static void shm_attach_view(sm_shm_t *s) {
+    sm_shm_header_t *h = s->h;
+    s->view.ctrl = (uint8_t*)h + h->ctrl_off;
+    s->view.keys = (char*)h + h->keys_off;
+    s->view.vals = (char*)h + h->vals_off;
+    s->view.cap = h->cap;
+    s->view.lgcap = h->lgcap;
+    s->view.size = h->size;
+    s->view.tombstones = h->tombstones;
+    s->key_size = h->key_size;
+    s->val_size = h->val_size;
+}
+
+sm_shm_t *sm_shm_create(int fd, uint64_t max_entries, sm_hash_fn hash, uint64_t hash_id, uint64_t key_size, uint64_t val_size) {
+    sm_shm_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SM_SHM_MAGIC, sizeof(h.magic));
+    h.version = SM_SHM_VERSION;
+    h.group_width = GROUP_WIDTH;
+    // room below the 80% load limit for max_entries plus a quarter as many
+    // tombstones, so deletes rehash at most once per max_entries / 4
+    h.cap = next_pow2((max_entries + max_entries / 4 + 2) * 5 / 4 + 1);
+    if (h.cap < GROUP_WIDTH) h.cap = GROUP_WIDTH;
+    h.lgcap = __builtin_ctzll(h.cap);
+    h.max_entries = max_entries;
+    h.key_size = key_size;
+    h.val_size = val_size;
+    h.hash_id = hash_id;
+    h.ctrl_off = SM_FILE_ALIGN;
+    h.keys_off = file_align(h.ctrl_off + h.cap + GROUP_WIDTH);
+    h.vals_off = file_align(h.keys_off + h.cap * key_size);
+    h.region_size = file_align(h.vals_off + h.cap * val_size);
+    if (ftruncate(fd, (off_t)h.region_size))
+        return NULL;
+
+    sm_shm_t *s = shm_map(fd, h.region_size, 1, hash);
+    if (!s) return NULL;
+    memcpy(s->h, &h, sizeof(h));
+    memset((char*)s->h + h.ctrl_off, EMPTY, h.cap + GROUP_WIDTH);
+    shm_attach_view(s);
+    return s;
+}
+
+sm_shm_t *sm_shm_attach(int fd, sm_hash_fn hash, uint64_t hash_id, int writable, uint64_t key_size, uint64_t val_size) {
+    sm_shm_header_t h;
+    struct stat st;
+    if (fstat(fd, &st) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+        return NULL;
+    if (memcmp(h.magic, SM_SHM_MAGIC, sizeof(h.magic)) || h.version != SM_SHM_VERSION
+        || h.group_width != GROUP_WIDTH || h.hash_id != hash_id
+        || h.key_size != key_size || h.val_size != val_size
+        || (uint64_t)st.st_size < h.region_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    sm_shm_t *s = shm_map(fd, h.region_size, writable, hash);
+    if (!s) return NULL;
+    shm_attach_view(s);
+    return s;
+}
+
+void sm_shm_detach(sm_shm_t *s) {
+    munmap(s->h, s->h->region_size);
+    free(s);
+}
+
+int sm_shm_find(sm_shm_t *s, const void *key, void *val) {
+    for (;;) {
+        uint64_t seq = atomic_load_explicit(&s->h->seq, memory_order_acquire);
+        if (seq & 1) {
+            _mm_pause();
+            continue;
+        }
+        void *v = sm_find(&s->view, key, s->key_size, s->val_size);
+        if (v && val) memcpy(val, v, s->val_size);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->h->seq, memory_order_relaxed) == seq)
+            return v != NULL;
+    }
+}
+
+static inline void shm_write_begin(sm_shm_t *s) {
+    atomic_store_explicit(&s->h->seq, s->h->seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->view.size = s->h->size;
+    s->view.tombstones = s->h->tombstones;
+}
+
+static inline void shm_write_end(sm_shm_t *s) {
+    s->h->size = s->view.size;
+    s->h->tombstones = s->view.tombstones;
+    atomic_store_explicit(&s->h->seq, s->h->seq + 1, memory_order_release);
+}
+
+// Tombstones a delete may leave before the table is rehashed; with at most
+// max_entries live keys this keeps every put under the 80% load limit.
+static inline uint64_t shm_tomb_budget(const sm_shm_header_t *h) {
+    return h->cap * 4 / 5 - h->max_entries - 1;
+}
+
+static void swap_bytes(char *a, char *b, uint64_t n) {
+    for (; n; a++, b++, n--) {
+        char t = *a;
+        *a = *b;
+        *b = t;
+    }
+}
+
+// Drops the tombstones without reallocating, since the region cannot grow:
+// DELETED becomes EMPTY and every full slot is marked DELETED, then each
+// marked entry goes to the first slot on its probe sequence that is not yet
+// final, swapping with the marked entry found there. Final slots never move
+// again, so a key only ever sits behind final slots on its sequence. Runs
+// inside a write section, so readers spin for the whole O(cap) pass.
+static void shm_rehash(sm_shm_t *s) {
+    swiss_map_generic_t *m = &s->view;
+    uint64_t ks = s->key_size, vs = s->val_size;
+    for (uint64_t i = 0; i < m->cap; i++)
+        m->ctrl[i] = m->ctrl[i] & 0x80 ? EMPTY : DELETED;
+    memcpy(m->ctrl + m->cap, m->ctrl, GROUP_WIDTH);
+    for (uint64_t i = 0; i < m->cap; i++) {
+        while (m->ctrl[i] == DELETED) {
+            char *k = (char*)m->keys + i * ks, *v = (char*)m->vals + i * vs;
+            uint64_t h = m->alloc.hash(k, ks);
+            uint64_t idx = index_for(h, m->lgcap), t;
+            for (;; idx = (idx + GROUP_SIZE) & (m->cap - 1)) {
+                uint32_t avail = match(EMPTY, &m->ctrl[idx]) | match(DELETED, &m->ctrl[idx]);
+                if (avail) {
+                    t = (idx + __builtin_ctz(avail)) & (m->cap - 1);
+                    break;
+                }
+            }
+            uint8_t h2 = ((uint8_t)(h >> 56)) & 0x7F;
+            if (t == i) {
+                set_ctrl(m, i, h2);
+            } else if (m->ctrl[t] == EMPTY) {
+                memcpy((char*)m->keys + t * ks, k, ks);
+                memcpy((char*)m->vals + t * vs, v, vs);
+                set_ctrl(m, t, h2);
+                set_ctrl(m, i, EMPTY);
+            } else {
+                // t holds another marked entry, which takes its turn at i
+                swap_bytes((char*)m->keys + t * ks, k, ks);
+                swap_bytes((char*)m->vals + t * vs, v, vs);
+                set_ctrl(m, t, h2);
+            }
+        }
+    }
+    m->tombstones = 0;
+}
+
+int sm_shm_put(sm_shm_t *s, const void *key, const void *val) {
+    if (!s->writable) {
+        errno = EBADF;
+        return -1;
+    }
+    // this is the only writer, so the lookup needs no write section
+    void *slot = sm_find(&s->view, key, s->key_size, s->val_size);
+    int inserted = 0;
+    if (!slot && s->h->size >= s->h->max_entries) {
+        errno = ENOSPC;
+        return -1;
+    }
+    shm_write_begin(s);
+    // the tombstone budget keeps this under the load limit, so it never has
+    // to grow or rehash
+    if (!slot)
+        slot = probe_insert(&s->view, s->view.alloc.hash(key, s->key_size), key, &inserted, s->key_size, s->val_size);
+    memcpy(slot, val, s->val_size);
+    shm_write_end(s);
+    return inserted;
+}
+
+int sm_shm_delete(sm_shm_t *s, const void *key) {
+    if (!s->writable) {
+        errno = EBADF;
+        return -1;
+    }
+    shm_write_begin(s);
+    int r = sm_delete(&s->view, key, s->key_size, s->val_size);
+    if (!r && s->view.tombstones > shm_tomb_budget(s->h))
+        shm_rehash(s);
+    shm_write_end(s);
+    return r;
+}
+
+uint64_t sm_shm_size(sm_shm_t *s) {
+    return s->h->size;
+}
+
+// Write-ahead log: a header block, then frames of
+//   uint64_t len, count, sum; len bytes of records
+// where a record is an op byte and the key, plus the value for WAL_PUT.
+// sum covers the records, so a frame torn by a crash fails its check and
+// ends the log. sm_get hands back the value slot before the caller fills
+// it, so puts are buffered with their slot and the values are read when
+// the batch is committed.
+#define SM_WAL_MAGIC   "SWISSWAL"
+#define SM_WAL_VERSION 1
+#define SM_WAL_HEADER  64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t key_size, val_size;
+} sm_wal_header_t;
+
+typedef struct {
+    uint64_t len, count, sum;
+} sm_wal_frame_t;
+
+typedef struct {
+    uint64_t off;  // record offset in buf
+    uint64_t slot; // where the key was when it was logged
+} sm_wal_pending_t;
+
+struct sm_wal {
+    int fd;
+    uint64_t end; // file offset of the next frame
+    uint64_t key_size, val_size;
+    swiss_map_generic_t *map;
+    char *buf;    // frame header, then records
+    uint64_t len, cap, batch, count;
+    sm_wal_pending_t *pending;
+    uint64_t npending, pending_cap;
+};
+
+// FNV-1a over 8 byte words rather than bytes, enough to catch a torn frame
+// without costing much at log rates.
+static uint64_t wal_sum(const char *p, uint64_t n) {
+    uint64_t h = 14695981039346656037ULL, w;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; n; p++, n--)
+        h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+    return h;
+}
+
+// Walks the frames after the header, calling fn on the records of each intact
+// one, and returns the offset just past the last of them.
+static uint64_t wal_scan(const char *base, uint64_t size, void (*fn)(const char *rec, uint64_t len, void *ctx), void *ctx) {
+    uint64_t off = SM_WAL_HEADER;
+    while (off + sizeof(sm_wal_frame_t) <= size) {
+        sm_wal_frame_t fr;
+        memcpy(&fr, base + off, sizeof(fr));
+        const char *rec = base + off + sizeof(fr);
+        if (fr.len > size - off - sizeof(fr) || wal_sum(rec, fr.len) != fr.sum)
+            break;
+        if (fn) fn(rec, fr.len, ctx);
+        off += sizeof(fr) + fr.len;
+    }
+    return off;
+}
+
+sm_wal_t *sm_wal_open(const char *path, uint64_t batch_bytes, uint64_t key_size, uint64_t val_size) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st)) goto fail;
+
+    sm_wal_header_t h;
+    uint64_t end = SM_WAL_HEADER;
+    if (st.st_size == 0) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, SM_WAL_MAGIC, sizeof(h.magic));
+        h.version = SM_WAL_VERSION;
+        h.key_size = key_size;
+        h.val_size = val_size;
+        if (ftruncate(fd, SM_WAL_HEADER) || write_all(fd, &h, sizeof(h), 0) || fdatasync(fd))
+            goto fail;
+    } else {
+        if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)
+            || memcmp(h.magic, SM_WAL_MAGIC, sizeof(h.magic)) || h.version != SM_WAL_VERSION
+            || h.key_size != key_size || h.val_size != val_size) {
+            errno = EINVAL;
+            goto fail;
+        }
+        // append after the last intact frame, dropping a torn tail
+        void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) goto fail;
+        end = wal_scan(base, (uint64_t)st.st_size, NULL, NULL);
+        munmap(base, (size_t)st.st_size);
+        if (end < (uint64_t)st.st_size && ftruncate(fd, (off_t)end))
+            goto fail;
+    }
+
+    sm_wal_t *w = calloc(1, sizeof(*w));
+    if (!w) goto fail;
+    w->fd = fd;
+    w->end = end;
+    w->key_size = key_size;
+    w->val_size = val_size;
+    w->batch = batch_bytes;
+    w->len = sizeof(sm_wal_frame_t);
+    return w;
+fail:
+    close(fd);
+    return NULL;
+}
+
+int sm_wal_attach(void *map, sm_wal_t *w) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    if (m->wal && sm_wal_commit(m->wal)) return -1;
+    if (m->wal) m->wal->map = NULL;
+    if (w) {
+        if (w->map && sm_wal_commit(w)) return -1;
+        if (w->map) w->map->wal = NULL;
+        w->map = m;
+    }
+    m->wal = w;
+    return 0;
+}
+
+int sm_wal_commit(sm_wal_t *w) {
+    if (w->len == sizeof(sm_wal_frame_t)) return 0;
+    uint64_t ks = w->key_size, vs = w->val_size;
+    swiss_map_generic_t *m = w->map;
+    for (uint64_t i = 0; i < w->npending; i++) {
+        char *rec = w->buf + w->pending[i].off;
+        uint64_t slot = w->pending[i].slot;
+        const void *v = NULL;
+        if (m && slot < m->cap && !(m->ctrl[slot] & 0x80)
+            && !memcmp((char*)m->keys + slot * ks, rec + 1, ks))
+            v = (char*)m->vals + slot * vs;
+        else if (m)
+            v = sm_find(m, rec + 1, ks, vs); // moved by a grow
+        // gone means a later record in this batch deleted it
+        if (v) memcpy(rec + 1 + ks, v, vs);
+        else *rec = WAL_SKIP;
+    }
+    sm_wal_frame_t fr = { w->len - sizeof(fr), w->count, 0 };
+    fr.sum = wal_sum(w->buf + sizeof(fr), fr.len);
+    memcpy(w->buf, &fr, sizeof(fr));
+    if (write_all(w->fd, w->buf, w->len, w->end) || fdatasync(w->fd)) {
+        // whatever reached the file fails its checksum or gets overwritten
+        return -1;
+    }
+    w->end += w->len;
+    w->len = sizeof(fr);
+    w->count = 0;
+    w->npending = 0;
+    return 0;
+}
+
+// Makes room in the batch for a record of need bytes, and a pending entry for
+// a put. -1 with errno ENOMEM if either array cannot grow.
+static int wal_room(sm_wal_t *w, uint64_t need, int put) {
+    if (w->len + need > w->cap) {
+        uint64_t cap = w->cap ? w->cap : 4096;
+        while (cap < w->len + need) cap *= 2;
+        char *b = realloc(w->buf, cap);
+        if (!b) return -1;
+        w->buf = b;
+        w->cap = cap;
+    }
+    if (put && w->npending == w->pending_cap) {
+        uint64_t cap = w->pending_cap ? w->pending_cap * 2 : 256;
+        sm_wal_pending_t *p = realloc(w->pending, cap * sizeof(*p));
+        if (!p) return -1;
+        w->pending = p;
+        w->pending_cap = cap;
+    }
+    return 0;
+}
+
+// Adds a record to the batch. Callers log before they change the map, so a
+// -1 here (errno set) fails the operation with the map as it was.
+static int wal_log(swiss_map_generic_t *m, int op, uint64_t slot, const void *key) {
+    sm_wal_t *w = m->wal;
+    uint64_t ks = w->key_size;
+    uint64_t need = op == WAL_CLEAR ? 1 : op == WAL_PUT ? 1 + ks + w->val_size : 1 + ks;
+    // Commit before appending: the record being logged is for a slot whose
+    // value the caller has not written yet. A failed commit keeps the batch
+    // and is retried by the next one.
+    if (w->len + need > w->batch && w->len > sizeof(sm_wal_frame_t))
+        sm_wal_commit(w);
+    // Out of memory: committing empties the batch, and the record may fit in
+    // what is already allocated.
+    if (unlikely(wal_room(w, need, op == WAL_PUT))
+        && (w->len == sizeof(sm_wal_frame_t) || sm_wal_commit(w) || wal_room(w, need, op == WAL_PUT)))
+        return -1;
+    char *rec = w->buf + w->len;
+    *rec = (char)op;
+    if (op != WAL_CLEAR)
+        memcpy(rec + 1, key, ks);
+    if (op == WAL_PUT)
+        w->pending[w->npending++] = (sm_wal_pending_t){ w->len, slot };
+    w->len += need;
+    w->count++;
+    return 0;
+}
+
+static void wal_discard(sm_wal_t *w) {
+    w->len = sizeof(sm_wal_frame_t);
+    w->count = 0;
+    w->npending = 0;
+}
+
+// Detaches the log for sm_free. It lets go of the map even if the last batch
+// cannot be written, and then drops the batch, which refers to slots about to
+// be freed.
+static int wal_release(swiss_map_generic_t *m) {
+    sm_wal_t *w = m->wal;
+    int err = sm_wal_commit(w);
+    if (err) wal_discard(w);
+    w->map = NULL;
+    m->wal = NULL;
+    return err;
+}
+
+int sm_wal_reset(sm_wal_t *w) {
+    wal_discard(w);
+    w->end = SM_WAL_HEADER;
+    return ftruncate(w->fd, SM_WAL_HEADER) || fdatasync(w->fd) ? -1 : 0;
+}
+
+int sm_wal_close(sm_wal_t *w) {
+    int err = sm_wal_commit(w);
+    if (w->map) w->map->wal = NULL;
+    err = close(w->fd) || err;
+    free(w->buf);
+    free(w->pending);
+    free(w);
+    return err ? -1 : 0;
+}
+
+typedef struct {
+    swiss_map_generic_t *m;
+    uint64_t key_size, val_size;
+    int err;
+} sm_replay_t;
+
+// Consecutive puts are applied 64 at a time, hashing and prefetching the
+// home groups of the window before inserting, as in sm_merge.
+static int replay_puts(swiss_map_generic_t *m, const char **recs, uint64_t n, uint64_t ks, uint64_t vs) {
+    uint64_t hashes[64];
+    sm_reserve(m, m->size + n, ks, vs);
+    for (uint64_t i = 0; i < n; i++) {
+        hashes[i] = m->alloc.hash(recs[i] + 1, ks);
+        uint64_t idx = index_for(hashes[i], m->lgcap);
+        __builtin_prefetch(&m->ctrl[idx], 0, 1);
+        __builtin_prefetch((char*)m->keys + idx * ks, 0, 1);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        int inserted;
+        if (unlikely(make_room(m, ks, vs)))
+            return -1;
+        memcpy(probe_insert(m, hashes[i], recs[i] + 1, &inserted, ks, vs), recs[i] + 1 + ks, vs);
+    }
+    return 0;
+}
+
+static void replay_frame(const char *rec, uint64_t len, void *ctx) {
+    sm_replay_t *r = ctx;
+    uint64_t ks = r->key_size, vs = r->val_size;
+    const char *puts[64], *end = rec + len;
+    uint64_t n = 0;
+    if (r->err) return;
+    while (rec < end && !r->err) {
+        int op = *rec;
+        if (op == WAL_PUT) {
+            puts[n++] = rec;
+            if (n == 64) {
+                r->err |= replay_puts(r->m, puts, n, ks, vs);
+                n = 0;
+            }
+            rec += 1 + ks + vs;
+            continue;
+        }
+        if (n) r->err |= replay_puts(r->m, puts, n, ks, vs);
+        n = 0;
+        if (op == WAL_DEL) sm_delete(r->m, rec + 1, ks, vs);
+        else if (op == WAL_CLEAR) sm_clear(r->m, 0, ks, vs);
+        rec += op == WAL_CLEAR ? 1 : op == WAL_DEL ? 1 + ks : 1 + ks + vs;
+    }
+    if (n) r->err |= replay_puts(r->m, puts, n, ks, vs);
+}
+
+void *sm_wal_replay(const char *snapshot, const char *log, sm_allocator_t allocs, uint64_t hash_id, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = NULL;
+    if (snapshot) {
+        m = sm_open(snapshot, allocs, hash_id, 0, key_size, val_size);
+        if (!m && errno != ENOENT) return NULL;
+    }
+    if (!m && !(m = sm_new(1024, key_size, val_size, allocs)))
+        return NULL;
+
+    int fd = open(log, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return m;
+        goto fail;
+    }
+    struct stat st;
+    sm_wal_header_t h;
+    if (fstat(fd, &st) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)
+        || memcmp(h.magic, SM_WAL_MAGIC, sizeof(h.magic)) || h.version != SM_WAL_VERSION
+        || h.key_size != key_size || h.val_size != val_size) {
+        errno = EINVAL;
+        close(fd);
+        goto fail;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) goto fail;
+    madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+    sm_replay_t r = { m, key_size, val_size, 0 };
+    wal_scan(base, (uint64_t)st.st_size, replay_frame, &r);
+    munmap(base, (size_t)st.st_size);
+    if (r.err) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    return m;
+fail:
+    sm_free(m, m->alloc);
+    return NULL;
+}
+
+// Frozen map: built once from a finished map at about 95% load. Homes are
+// spread over cap slots by a multiply-high (fastrange), so cap need not be a
+// power of two. Entries are placed in order of home slot, each in the first
+// free slot at or after its home, which is where linear probing would put
+// them; nothing is deleted later, so every slot between an entry's home and
+// its position is full. The last entries may run past cap into an overflow
+// tail instead of wrapping, and GROUP_WIDTH EMPTY bytes after the tail let a
+// group load start at any slot. At this load an EMPTY is rarely near, so
+// reach[b] records how many groups past its home the farthest entry homed in
+// block b (GROUP_WIDTH home slots) lies, and a lookup stops there.
+#define SM_FREEZE_LOAD 0.95
+
+struct sm_frozen {
+    sm_allocator_t alloc;
+    uint8_t *ctrl;
+    char *keys, *vals;
+    uint8_t *reach; // 255: use max_disp
+    uint64_t cap;   // home slots
+    uint64_t slots; // cap plus the overflow tail
+    uint64_t size, max_disp;
+    uint64_t key_size, val_size;
+};
+
+// h2 comes from the low bits since fastrange uses the high ones.
+static inline uint64_t frozen_home(uint64_t h, uint64_t cap) {
+    return (uint64_t)(((unsigned __int128)h * cap) >> 64);
+}
+
+sm_frozen_t *sm_freeze(void *map, uint64_t key_size, uint64_t val_size) {
+    swiss_map_generic_t *m = (swiss_map_generic_t*)map;
+    sm_allocator_t a = copy_allocator(m);
+    sm_frozen_t *f = a.alloc(a.ctx, sizeof(*f));
+    if (!f) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    f->alloc = a;
+    f->size = m->size;
+    f->cap = (uint64_t)((double)m->size / SM_FREEZE_LOAD) + 1;
+    f->key_size = key_size;
+    f->val_size = val_size;
+    f->max_disp = 0;
+
+    // Counting sort by home: start[h] first counts the entries homed at h,
+    // then becomes the slot the next of them goes to.
+    uint64_t *start = calloc(f->cap, sizeof(uint64_t));
+    if (!start) {
+        a.free(a.ctx, f);
+        return NULL;
+    }
+    sm_iter_t it;
+    void *k, *v;
+    sm_iter_begin(m, &it, key_size, val_size);
+    while (sm_iter_next(&it, &k, NULL))
+        start[frozen_home(a.hash(k, key_size), f->cap)]++;
+    uint64_t next = 0;
+    for (uint64_t h = 0; h < f->cap; h++) {
+        uint64_t n = start[h];
+        start[h] = next > h ? next : h;
+        next = start[h] + n;
+    }
+    f->slots = next > f->cap ? next : f->cap;
+
+    void *keys, *vals;
+    f->reach = a.alloc(a.ctx, f->cap / GROUP_WIDTH + 1);
+    if (!f->reach || alloc_arrays(&a, f->slots, key_size, val_size, &f->ctrl, &keys, &vals)) {
+        if (f->reach) a.free(a.ctx, f->reach);
+        free(start);
+        a.free(a.ctx, f);
+        errno = ENOMEM;
+        return NULL;
+    }
+    f->keys = keys;
+    f->vals = vals;
+    memset(f->ctrl, EMPTY, f->slots + GROUP_WIDTH);
+    memset(f->reach, 0, f->cap / GROUP_WIDTH + 1);
+    sm_iter_begin(m, &it, key_size, val_size);
+    while (sm_iter_next(&it, &k, &v)) {
+        uint64_t h = a.hash(k, key_size);
+        uint64_t home = frozen_home(h, f->cap);
+        uint64_t pos = start[home]++;
+        f->ctrl[pos] = h & 0x7F;
+        memcpy(f->keys + pos * key_size, k, key_size);
+        memcpy(f->vals + pos * val_size, v, val_size);
+        if (pos - home > f->max_disp) f->max_disp = pos - home;
+        uint64_t groups = (pos - home) / GROUP_WIDTH;
+        uint8_t *r = &f->reach[home / GROUP_WIDTH];
+        if (groups > *r) *r = groups < 255 ? groups : 255;
+    }
+    free(start);
+    return f;
+}
+
+const void *sm_frozen_find(const sm_frozen_t *f, const void *key) {
+    uint64_t ks = f->key_size;
+    uint64_t h = f->alloc.hash(key, ks);
+    uint8_t h2 = h & 0x7F;
+    uint64_t home = frozen_home(h, f->cap);
+    uint64_t reach = f->reach[home / GROUP_WIDTH];
+    uint64_t last = home + (reach < 255 ? reach * GROUP_WIDTH : f->max_disp);
+    for (uint64_t idx = home; idx <= last; idx += GROUP_WIDTH) {
+        uint32_t mask = match(h2, &f->ctrl[idx]);
+        while (mask) {
+            uint64_t pos = idx + __builtin_ctz(mask);
+            if (!memcmp(f->keys + pos * ks, key, ks))
+                return f->vals + pos * f->val_size;
+            mask &= mask - 1;
+        }
+        if (match(EMPTY, &f->ctrl[idx])) return NULL;
+    }
+    return NULL;
+}
+
+void sm_frozen_stats(const sm_frozen_t *f, sm_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->size = f->size;
+    out->cap = f->slots;
+    out->load = f->slots ? (double)f->size / (double)f->slots : 0;
+    out->ctrl_bytes = f->slots + GROUP_WIDTH + f->cap / GROUP_WIDTH + 1;
+    out->key_bytes = f->slots * f->key_size;
+    out->val_bytes = f->slots * f->val_size;
+
+    uint64_t probes = 0, false_pos = 0;
+    for (uint64_t i = 0; i < f->slots; i++) {
+        uint8_t c = f->ctrl[i];
+        if (c & 0x80) continue;
+        uint64_t home = frozen_home(f->alloc.hash(f->keys + i * f->key_size, f->key_size), f->cap);
+        // groups sm_frozen_find loads, and h2 hits before slot i
+        uint64_t n = (i - home) / GROUP_WIDTH + 1;
+        for (uint64_t j = home; j < i; j++)
+            false_pos += f->ctrl[j] == c;
+        probes += n;
+        if (n > out->max_probe) out->max_probe = n;
+        out->probe_hist[n < SM_PROBE_HIST ? n - 1 : SM_PROBE_HIST - 1]++;
+    }
+    if (f->size) {
+        out->avg_probe = (double)probes / (double)f->size;
+        out->h2_false_positives = (double)false_pos / (double)f->size;
+    }
+}
+
+void sm_frozen_free(sm_frozen_t *f) {
+    sm_allocator_t a = f->alloc;
+    a.free(a.ctx, f->ctrl);
+    a.free(a.ctx, f->keys);
+    a.free(a.ctx, f->vals);
+    a.free(a.ctx, f->reach);
+    a.free(a.ctx, f);
+}
+
+// Read-copy-update holder, with sleepable-RCU style reader counts rather
+// than per-thread registration: each thread is assigned one of
+// SM_RCU_SLOTS padded slots on first use (threads beyond that share), and a
+// reader bumps the count for the current epoch parity in its slot before
+// loading the map. A publisher swaps the pointer, then twice flips the
+// parity and waits for the counts of the parity it left to drain; two
+// phases are needed because a reader may have read the parity just before a
+// flip and only incremented it afterwards.
+#define SM_RCU_SLOTS 64
+
+typedef struct {
+    _Atomic uint64_t count[2];
+    char pad[64 - 2 * sizeof(uint64_t)];
+} sm_rcu_slot_t;
+
+struct sm_rcu {
+    sm_rcu_slot_t slots[SM_RCU_SLOTS];
+    _Atomic(void*) map;
+    _Atomic uint64_t epoch;
+    pthread_mutex_t publish;
+};
+
+static _Atomic uint32_t rcu_next_slot;
+static _Thread_local uint32_t rcu_slot = UINT32_MAX;
+
+sm_rcu_t *sm_rcu_new(void *m) {
+    sm_rcu_t *r;
+    if (posix_memalign((void**)&r, 64, sizeof(*r))) return NULL;
+    memset(r, 0, sizeof(*r));
+    atomic_init(&r->map, m);
+    pthread_mutex_init(&r->publish, NULL);
+    return r;
+}
+
+void *sm_rcu_read_lock(sm_rcu_t *r, int *token) {
+    if (unlikely(rcu_slot == UINT32_MAX))
+        rcu_slot = atomic_fetch_add_explicit(&rcu_next_slot, 1, memory_order_relaxed) % SM_RCU_SLOTS;
+    int idx = atomic_load_explicit(&r->epoch, memory_order_relaxed) & 1;
+    atomic_fetch_add(&r->slots[rcu_slot].count[idx], 1);
+    // the slot travels in the token so any thread can end the read section
+    *token = (int)(rcu_slot << 1 | idx);
+    return atomic_load(&r->map);
+}
+
+void sm_rcu_read_unlock(sm_rcu_t *r, int token) {
+    atomic_fetch_sub_explicit(&r->slots[(uint32_t)token >> 1].count[token & 1], 1, memory_order_release);
+}
+
+void sm_rcu_synchronize(sm_rcu_t *r) {
+    pthread_mutex_lock(&r->publish);
+    for (int phase = 0; phase < 2; phase++) {
+        int idx = atomic_fetch_add(&r->epoch, 1) & 1;
+        for (uint32_t i = 0; i < SM_RCU_SLOTS; i++)
+            while (atomic_load_explicit(&r->slots[i].count[idx], memory_order_acquire))
+                sched_yield();
+    }
+    pthread_mutex_unlock(&r->publish);
+}
+
+void sm_rcu_publish(sm_rcu_t *r, void *m) {
+    swiss_map_generic_t *old = atomic_exchange(&r->map, m);
+    sm_rcu_synchronize(r);
+    if (old) sm_free(old, old->alloc);
+}
+
+void sm_rcu_free(sm_rcu_t *r) {
+    swiss_map_generic_t *m = atomic_load(&r->map);
+    if (m) sm_free(m, m->alloc);
+    pthread_mutex_destroy(&r->publish);
+    free(r);
+}
@@ -7,6 +7,10 @@
 typedef void*(*sm_alloc_fn)(void* ctx, uint64_t n);
 typedef void(*sm_free_fn)(void* ctx, void* p);
 typedef uint64_t(*sm_hash_fn)(const void *data, uint64_t len);
+typedef int(*sm_eq_fn)(const void *key, void *ctx);
+typedef void(*sm_copy_fn)(void *key, void *ctx);
+typedef void(*sm_visit_fn)(void *key, void *val, uint64_t chunk, void *ctx);
+typedef void(*sm_combine_fn)(void *dst_val, const void *src_val, const void *key, void *ctx);
 
 typedef struct {
     void* ctx;
@@ -15,12 +19,273 @@ typedef struct {
     sm_hash_fn hash;
 } sm_allocator_t;
 
+// Building hash.c and its users with -DSM_INSTRUMENT adds these counters to
+// every map; without it the counting compiles away and sm_counters is NULL.
+typedef struct {
+    uint64_t probes;
+    uint64_t h2_matches;
+    uint64_t memcmps;
+    uint64_t memcmp_misses;
+    uint64_t grows;
+    uint64_t grow_ns;
+    uint64_t bytes_copied;
+} sm_counters_t;
+
+#ifdef SM_INSTRUMENT
+#define SM_COUNTERS_FIELD sm_counters_t counters;
+#else
+#define SM_COUNTERS_FIELD
+#endif
+
+// Per-region change bits for incremental checkpoints, see sm_track_dirty.
+typedef struct sm_dirty sm_dirty_t;
+// Write-ahead log a map appends its changes to, see sm_wal_open.
+typedef struct sm_wal sm_wal_t;
+
+#define SM_PROBE_HIST 16
+
+// sm_clear flags. SHRINK reallocates at the capacity the entries just
+// cleared would need, when that is at most a quarter of the current one; if
+// that allocation fails the map is cleared at its current capacity instead.
+// RELEASE keeps the capacity but returns the key and value pages to the
+// kernel, so a huge map that stays empty for a while stops holding memory.
+#define SM_CLEAR_SHRINK  1
+#define SM_CLEAR_RELEASE 2
+
+// Snapshot files record which hash function placed the keys, since the
+// function pointer itself cannot be saved. These name the two that ship with
+// the library; other functions can use any other value consistently.
+#define SM_HASH_FNV1A 1
+#define SM_HASH_XXH3  2
+
+// sm_open flags: map the snapshot read-only rather than copy-on-write.
+#define SM_OPEN_READONLY 1
+
+// What sm_merge does with a key present in both maps: keep dst's value,
+// take src's, or call the combine function on the pair.
+#define SM_MERGE_KEEP      0
+#define SM_MERGE_OVERWRITE 1
+#define SM_MERGE_COMBINE   2
+
+typedef struct {
+    uint64_t size, cap, tombstones;
+    double load;
+    uint64_t ctrl_bytes, key_bytes, val_bytes;
+    // Groups a successful lookup scans; probe_hist[SM_PROBE_HIST-1] collects
+    // everything at or beyond that length.
+    double avg_probe;
+    uint64_t max_probe;
+    uint64_t probe_hist[SM_PROBE_HIST];
+    // h2 matches per successful lookup whose key compare fails.
+    double h2_false_positives;
+} sm_stats_t;
+
+typedef struct {
+    const void *data;
+    uint64_t len;
+} sm_slice_t;
+
+typedef struct {
+    const sm_slice_t *v;
+    uint64_t n;
+} sm_slices_t;
+
+// Cursor over the live entries of a map. The header half hands out slots
+// from a bitmap of full ctrl bytes; sm_iter_refill builds the next 64-slot
+// bitmap a SIMD group at a time, so runs of EMPTY/DELETED slots cost one
+// movemask per group. It can be kept across calls and resumed. Erasing the
+// entry just returned is fine; an insert may grow the map and invalidates it.
+typedef struct {
+    const uint8_t *ctrl;
+    char *keys, *vals;
+    uint64_t key_size, val_size;
+    uint64_t end;  // one past the last slot to visit
+    uint64_t base; // slot of bit 0 in mask
+    uint64_t next; // first slot not yet loaded into a mask
+    uint64_t mask; // full slots in [base, next) not yet returned
+} sm_iter_t;
+
 sm_allocator_t sm_mmap_allocator(void);
+// NULL with errno ENOMEM if the allocator refuses any of the arrays.
 void *sm_new(uint64_t init_cap, uint64_t key_size, uint64_t val_size, sm_allocator_t allocs);
-void sm_free(void *m, sm_allocator_t allocs);
+// 0, or -1 with errno set if the final commit of an attached log failed; the
+// map is freed either way and that batch is lost.
+int sm_free(void *m, sm_allocator_t allocs);
 void *sm_find(void *m, const void *key, uint64_t key_size, uint64_t val_size);
 void *sm_get(void *m, const void *key, int *inserted, uint64_t key_size, uint64_t val_size);
 int sm_delete(void *m, const void *key, uint64_t key_size, uint64_t val_size);
+// Grows the map once so that it holds n entries without resizing again.
+// 0 on success, -1 with errno ENOMEM if the allocator refused (the map is
+// unchanged). sm_get and sm_get_hashed return NULL in that case.
+int sm_reserve(void *m, uint64_t n, uint64_t key_size, uint64_t val_size);
+// Inserts every entry of src into dst, resolving shared keys per policy, and
+// returns how many keys were new to dst. Both maps must have the same key
+// and value sizes; src is left untouched. If dst cannot grow, or its log
+// cannot record an insert, it stops early with errno set, returning the
+// count so far.
+uint64_t sm_merge(void *dst, void *src, int policy, sm_combine_fn combine, void *ctx, uint64_t key_size, uint64_t val_size);
+// A map of the same capacity and allocator holding the same entries, made by
+// copying the arrays rather than reinserting; free it with sm_free. A copy of
+// a map from sm_open gets the allocs it was opened with, so it outlives it.
+// NULL with errno ENOMEM if the allocator refuses.
+void *sm_clone(void *m, uint64_t key_size, uint64_t val_size);
+// Empties the map without freeing it: O(cap) memset of ctrl, no unmapping.
+// -1 only if an attached log cannot record it.
+int sm_clear(void *m, int flags, uint64_t key_size, uint64_t val_size);
+void sm_stats(void *m, sm_stats_t *out, uint64_t key_size, uint64_t val_size);
+sm_counters_t *sm_counters(void *m);
+
+// Lookups for keys that are not contiguous in memory. hash must equal what the
+// map's sm_hash_fn returns for the assembled key (e.g. XXH3_64bits_digest when
+// the map hashes with XXH3_64bits), eq compares a stored key against ctx and
+// copy assembles the key into a fresh slot on insert.
+void *sm_find_hashed(void *m, uint64_t hash, sm_eq_fn eq, void *ctx, uint64_t key_size, uint64_t val_size);
+void *sm_get_hashed(void *m, uint64_t hash, sm_eq_fn eq, sm_copy_fn copy, void *ctx, int *inserted, uint64_t key_size, uint64_t val_size);
+int sm_delete_hashed(void *m, uint64_t hash, sm_eq_fn eq, void *ctx, uint64_t key_size, uint64_t val_size);
+int sm_slices_eq(const void *key, void *ctx);
+void sm_slices_copy(void *key, void *ctx);
+
+// Writes the map to path (atomically, via path.tmp and a rename) in a form
+// sm_open can map straight back. 0 on success, -1 with errno set otherwise.
+int sm_save(void *m, const char *path, uint64_t hash_id, uint64_t key_size, uint64_t val_size);
+// Immutable copy of a finished map for lookup-only use, about 95% full with
+// no tombstones and no room to grow, where a map between doublings sits at
+// 40-80%. Built from m (left as it is) with m's allocator and hash; the
+// sizes are remembered, so the lookups take only the key. sm_frozen_stats
+// reports the same figures as sm_stats, with cap counting the overflow slots.
+// sm_freeze returns NULL with errno ENOMEM if an allocation fails.
+typedef struct sm_frozen sm_frozen_t;
+sm_frozen_t *sm_freeze(void *m, uint64_t key_size, uint64_t val_size);
+const void *sm_frozen_find(const sm_frozen_t *f, const void *key);
+void sm_frozen_stats(const sm_frozen_t *f, sm_stats_t *out);
+void sm_frozen_free(sm_frozen_t *f);
+
+// Holder for a map that is rebuilt whole and swapped in while other threads
+// read it. Readers bracket their lookups with sm_rcu_read_lock, which returns
+// the current map, and sm_rcu_read_unlock with the token it set; the unlock
+// may run on another thread. Neither takes a lock, and the map must not be
+// used after the unlock. Readers must not modify the map. sm_rcu_publish installs a new map and, once every
+// reader that might still see the old one has left, frees it with
+// sm_free(old, old->alloc). Publishers are serialised; a reader must not
+// publish from inside its own read section. sm_rcu_synchronize only waits.
+typedef struct sm_rcu sm_rcu_t;
+sm_rcu_t *sm_rcu_new(void *m);
+void *sm_rcu_read_lock(sm_rcu_t *r, int *token);
+void sm_rcu_read_unlock(sm_rcu_t *r, int token);
+void sm_rcu_publish(sm_rcu_t *r, void *m);
+void sm_rcu_synchronize(sm_rcu_t *r);
+// Frees the holder and its current map; no reader may be inside.
+void sm_rcu_free(sm_rcu_t *r);
+
+// Starts tracking which regions of region_slots slots (rounded up to a power
+// of two) change, so sm_checkpoint can rewrite only those; 0 stops tracking.
+// sm_get, sm_delete and their _hashed forms mark the slot they return or
+// erase. Writes through a pointer from sm_find are not seen, so update
+// values via sm_get. A region of 4096 / val_size slots is about one page of
+// values. 0 on success, -1 if the bitmap could not be allocated.
+int sm_track_dirty(void *m, uint64_t region_slots);
+// Brings the snapshot at path up to date. With tracking on and path holding
+// this map's last full checkpoint at the same capacity, the regions changed
+// since then are written to path.delta, which sm_open applies on top of the
+// snapshot; otherwise (first call, after a grow or clear, once the delta
+// would cover half the table, or tracking off) this is sm_save. Both files
+// are only ever replaced by rename, so a crash mid-checkpoint leaves the
+// previous checkpoint readable. 0 on success, -1 with errno set.
+int sm_checkpoint(void *m, const char *path, uint64_t hash_id, uint64_t key_size, uint64_t val_size);
+// Write-ahead log. sm_wal_open creates path or reopens it for appending,
+// discarding a frame torn by a crash. Once attached, every sm_get (insert or
+// update), sm_delete and sm_clear of the map is buffered as a record, and
+// records go to the file together: sm_wal_commit writes the batch with one
+// fdatasync, and a batch is committed by itself once it reaches batch_bytes.
+// Values are read at commit time, so a put is logged with whatever the slot
+// holds by then and values must be updated through sm_get, not through a
+// pointer from sm_find. Only what was committed survives a crash. If a record
+// cannot be buffered even after committing the batch early, the operation
+// fails with errno set and leaves the map unchanged: sm_get returns NULL and
+// sm_delete and sm_clear return -1.
+sm_wal_t *sm_wal_open(const char *path, uint64_t batch_bytes, uint64_t key_size, uint64_t val_size);
+// Logs m's changes to w, committing whatever either was logging before; a
+// NULL w stops logging. One log per map and one map per log.
+int sm_wal_attach(void *m, sm_wal_t *w);
+int sm_wal_commit(sm_wal_t *w);
+// Empties the log, typically right after a snapshot or checkpoint of the map.
+int sm_wal_reset(sm_wal_t *w);
+int sm_wal_close(sm_wal_t *w);
+// Rebuilds a map from a snapshot (opened with sm_open; NULL or a missing file
+// starts empty) followed by the committed records of log. Replaying records
+// already contained in the snapshot is harmless. Returns NULL with errno set
+// if either file is unusable. Free with sm_free(m, m->alloc).
+void *sm_wal_replay(const char *snapshot, const char *log, sm_allocator_t allocs, uint64_t hash_id, uint64_t key_size, uint64_t val_size);
+// Maps a snapshot, plus path.delta if sm_checkpoint left one for it, and
+// returns a map using it in place: nothing is rehashed or read until a
+// lookup touches it. Writes are copy-on-write and never reach the file, or
+// fault with SM_OPEN_READONLY. allocs supplies the hash function and the
+// memory for anything allocated later, such as a grow. Returns NULL with
+// errno set, EINVAL when the file does not match hash_id, the sizes or this
+// build's group width. Free with sm_free(m, m->alloc).
+void *sm_open(const char *path, sm_allocator_t allocs, uint64_t hash_id, int flags, uint64_t key_size, uint64_t val_size);
+
+// A map kept in a file mapped MAP_SHARED, so it outlives the process.
+// sm_pfile_open maps (or creates) the file inside a max_size reservation of
+// address space and takes an exclusive lock on it; allocations past the end
+// grow the file in place, and fail once it would exceed max_size; a grow
+// that fails leaves the map as it was and sm_get returns NULL.
+// sm_pfile_map returns the map stored in the file, creating it with init_cap
+// on first use; hash_id and the sizes must match what it was created with
+// (EINVAL), and a new map must fit in max_size (ENOMEM).
+// Every change lands in the page cache immediately; sm_pfile_sync msyncs it
+// to disk, sm_pfile_close syncs and unmaps. sm_free on the map deletes it
+// from the file.
+typedef struct sm_pfile sm_pfile_t;
+sm_pfile_t *sm_pfile_open(const char *path, uint64_t max_size);
+sm_allocator_t sm_pfile_allocator(sm_pfile_t *f, sm_hash_fn hash);
+void *sm_pfile_map(sm_pfile_t *f, uint64_t init_cap, sm_hash_fn hash, uint64_t hash_id, uint64_t key_size, uint64_t val_size);
+int sm_pfile_sync(sm_pfile_t *f);
+int sm_pfile_close(sm_pfile_t *f);
+
+// A fixed-capacity map shared between processes through a file descriptor
+// (shm_open, memfd_create, or a regular file), addressed by offsets so each
+// process may map it anywhere. sm_shm_create sizes fd for max_entries and
+// initialises it; other processes sm_shm_attach to the same fd. Only one
+// process may write. Readers copy the value out under a sequence lock and
+// retry if the writer changed the table meanwhile, so lookups never see a
+// torn entry. sm_shm_put returns 1 for a new key, 0 for an update and -1
+// (errno ENOSPC) for a new key once max_entries is reached; sm_shm_find
+// returns 1 and fills val (if not NULL) when the key is present. The table
+// is sized with room for max_entries / 4 tombstones on top of max_entries;
+// the delete that exceeds that rehashes the table in place, without extra
+// memory, and readers wait out that O(capacity) pass. Puts never rehash.
+typedef struct sm_shm sm_shm_t;
+sm_shm_t *sm_shm_create(int fd, uint64_t max_entries, sm_hash_fn hash, uint64_t hash_id, uint64_t key_size, uint64_t val_size);
+sm_shm_t *sm_shm_attach(int fd, sm_hash_fn hash, uint64_t hash_id, int writable, uint64_t key_size, uint64_t val_size);
+void sm_shm_detach(sm_shm_t *s);
+int sm_shm_find(sm_shm_t *s, const void *key, void *val);
+int sm_shm_put(sm_shm_t *s, const void *key, const void *val);
+int sm_shm_delete(sm_shm_t *s, const void *key);
+uint64_t sm_shm_size(sm_shm_t *s);
+
+void sm_iter_begin(void *m, sm_iter_t *it, uint64_t key_size, uint64_t val_size);
+int sm_iter_refill(sm_iter_t *it);
+
+// Splits the slots into nchunks contiguous ranges on 64-slot boundaries and
+// positions it at range chunk, for callers that run their own threads. Some
+// ranges are empty when the map has fewer than 64 * nchunks slots.
+void sm_iter_chunk(void *m, sm_iter_t *it, uint64_t chunk, uint64_t nchunks, uint64_t key_size, uint64_t val_size);
+
+// Calls fn on every entry from nthreads threads, one chunk each, passing the
+// chunk index so callers can keep per-thread accumulators without locking.
+// The map must not be modified until it returns.
+void sm_for_each_parallel(void *m, uint64_t nthreads, sm_visit_fn fn, void *ctx, uint64_t key_size, uint64_t val_size);
+
+static inline int sm_iter_next(sm_iter_t *it, void **key, void **val) {
+    if (!it->mask && !sm_iter_refill(it))
+        return 0;
+    uint64_t i = it->base + (uint64_t)__builtin_ctzll(it->mask);
+    it->mask &= it->mask - 1;
+    if (key) *key = it->keys + i * it->key_size;
+    if (val) *val = it->vals + i * it->val_size;
+    return 1;
+}
 
 #define map(m, key_t, val_t, allocs)                                 \
     typedef struct {                                                   \
@@ -30,6 +295,10 @@ int sm_delete(void *m, const void *key, uint64_t key_size, uint64_t val_size);
         val_t  *vals;                                              \
         uint64_t cap, size;                                         \
         uint64_t lgcap;                                               \
+        uint64_t tombstones;                                          \
+        sm_dirty_t *dirty;                                            \
+        sm_wal_t *wal;                                                \
+        SM_COUNTERS_FIELD                                              \
     } m##_t;                                                           \
                                                                        \
     static m##_t *m = NULL;                                            \
@@ -45,7 +314,9 @@ int sm_delete(void *m, const void *key, uint64_t key_size, uint64_t val_size);
     static inline int m##_put(key_t k, val_t v) {                      \
         if (!m) m##_init();                                              \
         int ins;                                                         \
-        *(val_t*)sm_get(m, &k, &ins, sizeof(key_t), sizeof(val_t)) = v;  \
+        val_t *slot = (val_t*)sm_get(m, &k, &ins, sizeof(key_t), sizeof(val_t)); \
+        if (!slot) return -1;                                            \
+        *slot = v;                                                       \
         return ins;                                                      \
     }                                                                  \
                                                                        \
@@ -54,6 +325,20 @@ int sm_delete(void *m, const void *key, uint64_t key_size, uint64_t val_size);
         return sm_delete(m, &k, sizeof(key_t), sizeof(val_t));          \
     }                                                                  \
                                                                        \
+    static inline m##_t *m##_clone(void) {                             \
+        if (!m) m##_init();                                              \
+        return (m##_t*)sm_clone(m, sizeof(key_t), sizeof(val_t));       \
+    }                                                                  \
+                                                                       \
+    static inline void m##_clear(int flags) {                          \
+        if (m) sm_clear(m, flags, sizeof(key_t), sizeof(val_t));         \
+    }                                                                  \
+                                                                       \
+    static inline void m##_stats(sm_stats_t *out) {                    \
+        if (!m) m##_init();                                              \
+        sm_stats(m, out, sizeof(key_t), sizeof(val_t));                  \
+    }                                                                  \
+                                                                       \
     static inline void m##_del(void) {                                 \
         if (m) {                                                         \
           sm_free(m, m->alloc);                                          \
@@ -65,12 +350,15 @@ int sm_delete(void *m, const void *key, uint64_t key_size, uint64_t val_size);
 #define get(m, k)    m##_get(k)
 #define erase(m, k)  m##_erase(k)
 #define delete(m)    m##_del()
+#define stats(m, s)  m##_stats(s)
+#define clear(m, f)  m##_clear(f)
 
 #define for_each(m, k, v)                                                    \
-    for (uint8_t* _ctrl = (m)->ctrl, *_end = _ctrl + (m)->cap; _ctrl < _end; ++_ctrl)                                                           \
-        if (!(*_ctrl & 0x80))                                                  \
-            for (__typeof__(*(m)->vals)* v = (m)->vals + (_ctrl - (m)->ctrl); v; v = NULL) \
-                for (__typeof__(*(m)->keys)* k = (m)->keys + (_ctrl - (m)->ctrl); k; k = NULL)
+    for (sm_iter_t _it, *_itp = (sm_iter_begin((m), &_it, sizeof(*(m)->keys), sizeof(*(m)->vals)), &_it); \
+         _itp; _itp = NULL)                                                    \
+        for (void *_k, *_v; sm_iter_next(&_it, &_k, &_v);)                     \
+            for (__typeof__(*(m)->vals)* v = _v; v; v = NULL)                  \
+                for (__typeof__(*(m)->keys)* k = _k; k; k = NULL)
 
 #define EMPTY      0x80u
 #define DELETED    0xFEu
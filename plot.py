@@ -4,22 +4,84 @@ import pandas as pd
 import matplotlib.pyplot as plt
 
 groups = {
-    "":  "1024 byte key / 1032 byte value",
-    "8": "8 byte key / 8 byte value",
-    "r": "random 1024 byte key / 1032 byte value",
-    "r8": "random 8 byte key / 8 byte value",
+    "k1024v1024":  "1024 byte key / 1024 byte value",
+    "k8v8":        "8 byte key / 8 byte value",
+    "k1024v1024r": "random 1024 byte key / 1024 byte value",
+    "k8v8r":       "random 8 byte key / 8 byte value",
+    "k16v64":      "16 byte key / 64 byte value",
+    "k32v8":       "32 byte key / 8 byte value",
+    "k8v8x50":     "8 byte key / 8 byte value, 50% lookup misses",
+    "k32v8x50":    "32 byte key / 8 byte value, 50% lookup misses",
+    "k8v8d50":     "8 byte key / 8 byte value, 50% deleted first, 50% lookup misses",
+}
+
+# access skew: suffix appended to a base group -> column label
+skews = {
+    "":      "uniform",
+    "z0.5":  "Zipf 0.5",
+    "z0.99": "Zipf 0.99",
+    "z1.2":  "Zipf 1.2",
+    "w4096": "window 4096",
+}
+skew_bases = {"k8v8": "8 byte key / 8 byte value", "k16v64": "16 byte key / 64 byte value"}
+for base, desc in skew_bases.items():
+    for suffix, label in skews.items():
+        if suffix:
+            groups[base + suffix] = f"{desc}, {label} access"
+
+sweep_groups = {
+    "k8v8":  "8 byte key / 8 byte value",
+    "k32v8": "32 byte key / 8 byte value",
+}
+
+memory_groups = {
+    "k8v8":       "8 byte key / 8 byte value",
+    "k16v64":     "16 byte key / 64 byte value",
+    "k32v8":      "32 byte key / 8 byte value",
+    "k1024v1024": "1024 byte key / 1024 byte value",
 }
 
 implementations = ["boost", "ska", "swiss"]
-operations      = ["Insert", "Lookup", "Delete"]
+operations      = ["Insert", "Lookup", "LookupMiss", "Delete"]
+tp_operations   = ["Insert", "Lookup", "Delete", "Mixed"]
+sweep_operations = ["Lookup", "LookupMiss"]
+percentiles     = [("p50", 0.5), ("p90", 0.9), ("p99", 0.99), ("p99.9", 0.999)]
 data_dir        = ".temp"
+perf_counters   = [("Cycles", "cycles_per_op"), ("Instr", "instructions_per_op"),
+                   ("L1d miss", "l1d_misses_per_op"), ("LLC miss", "llc_misses_per_op"),
+                   ("dTLB miss", "dtlb_misses_per_op"), ("Branch miss", "branch_misses_per_op"),
+                   ("Page faults", "page_faults_per_op")]
+
+def hist_summary(fn, op):
+    """Mean, std, percentiles and max of every timed op from a -H histogram.
+
+    Percentiles report the upper edge of the bucket they fall in.
+    """
+    df = pd.read_csv(fn)
+    df = df[df['operation'] == op]
+    if df.empty:
+        return None
+    counts = df['count'].to_numpy()
+    hi     = df['hi_ns'].to_numpy()
+    mid    = (df['lo_ns'].to_numpy() + hi) / 2
+    total  = counts.sum()
+    mean   = (mid * counts).sum() / total
+    out = {
+        "Mean (ns)": f"{mean:.2f}",
+        "Std (ns)":  f"{np.sqrt(((mid - mean) ** 2 * counts).sum() / total):.2f}",
+        "Max (ns)":  f"{hi[-1]}",
+    }
+    cum = np.cumsum(counts)
+    for name, q in percentiles:
+        out[f"{name} (ns)"] = f"{hi[np.searchsorted(cum, q * total)]}"
+    return out
 
-for suffix, desc in groups.items():
+for group, desc in groups.items():
     for op in operations:
         plt.figure(figsize=(6,4))
 
         for impl in implementations:
-            fn = os.path.join(data_dir, f"{impl}{suffix}.csv")
+            fn = os.path.join(data_dir, f"{impl}_{group}.csv")
             if not os.path.exists(fn):
                 continue
 
@@ -48,18 +110,52 @@ for suffix, desc in groups.items():
         plt.title(f"{op} Operation ({desc})")
         plt.legend(title="Impl")
         plt.tight_layout()
-        out = f"{op.lower()}_{suffix or 'nosuffix'}.png"
+        out = f"{op.lower()}_{group}.png"
         plt.savefig(out, dpi=300)
         plt.close()
 
-for suffix, desc in groups.items():
-    grp_name = suffix or "nosuffix"
-    print(f"## Group `{grp_name}`: {desc}\n")
+for group, desc in groups.items():
+    for op in tp_operations:
+        plotted = False
+        plt.figure(figsize=(6,4))
+
+        for impl in implementations:
+            fn = os.path.join(data_dir, f"{impl}_{group}_tp.csv")
+            if not os.path.exists(fn):
+                continue
+
+            df    = pd.read_csv(fn)
+            df_op = df[df['operation'] == op]
+            if df_op.empty:
+                continue
+
+            plt.plot(df_op['count'].to_numpy(), df_op['ns_per_op'].to_numpy(), label=impl)
+            plotted = True
+
+        if plotted:
+            plt.xlabel(r'Count ($n$)')
+            plt.ylabel(r'Batch time per op (ns)')
+            plt.title(f"{op} Throughput ({desc})")
+            plt.legend(title="Impl")
+            plt.tight_layout()
+            plt.savefig(f"{op.lower()}_{group}_tp.png", dpi=300)
+        plt.close()
+
+for group, desc in groups.items():
+    print(f"## Group `{group}`: {desc}\n")
 
     for op in operations:
         rows = []
         for impl in implementations:
-            fn = os.path.join(data_dir, f"{impl}{suffix}.csv")
+            hist_fn = os.path.join(data_dir, f"{impl}_{group}_hist.csv")
+            if os.path.exists(hist_fn):
+                summary = hist_summary(hist_fn, op)
+                if summary:
+                    rows.append({"Impl": impl, **summary})
+                continue
+
+            # no histogram: fall back to the sampled series
+            fn = os.path.join(data_dir, f"{impl}_{group}.csv")
             if not os.path.exists(fn):
                 continue
             df_all = pd.read_csv(fn)
@@ -80,8 +176,212 @@ for suffix, desc in groups.items():
 
         print(f"### Operation: {op}\n")
         headers = ["Impl", "Mean (ns)", "Std (ns)"]
+        headers += [f"{name} (ns)" for name, _ in percentiles] + ["Max (ns)"]
+        print("| " + " | ".join(headers) + " |")
+        print("| " + " | ".join("---" for _ in headers) + " |")
+        for row in rows:
+            print("| " + " | ".join(row.get(h, "-") for h in headers) + " |")
+        print()
+
+    rows = []
+    for impl in implementations:
+        fn = os.path.join(data_dir, f"{impl}_{group}_tp.csv")
+        if not os.path.exists(fn):
+            continue
+        df = pd.read_csv(fn)
+        for op in tp_operations:
+            df_op = df[df['operation'] == op]
+            if df_op.empty:
+                continue
+            ops, ns = df_op['ops'].sum(), df_op['ns'].sum()
+            rows.append({
+                "Impl":      impl,
+                "Operation": op,
+                "Mops/s":    f"{ops * 1e3 / ns:.2f}",
+                "ns/op":     f"{ns / ops:.2f}"
+            })
+
+    if rows:
+        print(f"### Throughput\n")
+        headers = ["Impl", "Operation", "Mops/s", "ns/op"]
         print("| " + " | ".join(headers) + " |")
         print("| " + " | ".join("---" for _ in headers) + " |")
         for row in rows:
             print("| " + " | ".join(row[h] for h in headers) + " |")
         print()
+
+    rows = []
+    for impl in implementations:
+        fn = os.path.join(data_dir, f"{impl}_{group}_perf.csv")
+        if not os.path.exists(fn):
+            continue
+        df = pd.read_csv(fn)
+        for _, r in df.iterrows():
+            row = {"Impl": impl, "Operation": r['operation']}
+            for name, col in perf_counters:
+                row[name] = "-" if pd.isna(r[col]) else f"{r[col]:.3f}"
+            rows.append(row)
+
+    if rows:
+        print(f"### Hardware counters per op\n")
+        headers = ["Impl", "Operation"] + [name for name, _ in perf_counters]
+        print("| " + " | ".join(headers) + " |")
+        print("| " + " | ".join("---" for _ in headers) + " |")
+        for row in rows:
+            print("| " + " | ".join(row[h] for h in headers) + " |")
+        print()
+
+for group, desc in sweep_groups.items():
+    frames = {}
+    for impl in implementations:
+        fn = os.path.join(data_dir, f"{impl}_{group}_sweep.csv")
+        if os.path.exists(fn):
+            frames[impl] = pd.read_csv(fn)
+    if not frames:
+        continue
+
+    plt.figure(figsize=(6,4))
+    for impl, df in frames.items():
+        for op in sweep_operations:
+            df_op = df[df['operation'] == op]
+            plt.plot(df_op['fill'].to_numpy(), df_op['ns_per_op'].to_numpy(),
+                     label=f"{impl} {op}", linestyle='-' if op == "Lookup" else '--')
+    plt.xlabel(r'Fill (% of reserved $n$)')
+    plt.ylabel(r'Time per lookup (ns)')
+    plt.title(f"Lookup by fill level ({desc})")
+    plt.legend(title="Impl")
+    plt.tight_layout()
+    plt.savefig(f"sweep_{group}.png", dpi=300)
+    plt.close()
+
+    print(f"## Sweep `{group}`: {desc}\n")
+    headers = ["Impl", "Fill (%)", "Load", "Hit (ns)", "Miss (ns)"]
+    print("| " + " | ".join(headers) + " |")
+    print("| " + " | ".join("---" for _ in headers) + " |")
+    for impl, df in frames.items():
+        hit  = df[df['operation'] == "Lookup"].set_index('fill')
+        miss = df[df['operation'] == "LookupMiss"].set_index('fill')
+        for fill in hit.index:
+            print(f"| {impl} | {fill} | {hit.loc[fill, 'load']:.3f} | "
+                  f"{hit.loc[fill, 'ns_per_op']:.2f} | {miss.loc[fill, 'ns_per_op']:.2f} |")
+    print()
+
+for base, desc in skew_bases.items():
+    rows = []
+    for impl in implementations:
+        row = {"Impl": impl}
+        for suffix, label in skews.items():
+            fn = os.path.join(data_dir, f"{impl}_{base}{suffix}_tp.csv")
+            if not os.path.exists(fn):
+                continue
+            df = pd.read_csv(fn)
+            df = df[df['operation'] == "Lookup"]
+            if not df.empty:
+                row[label] = f"{df['ns'].sum() / df['ops'].sum():.2f}"
+        if len(row) > 1:
+            rows.append(row)
+    if not rows:
+        continue
+
+    print(f"## Lookup ns/op by access skew: {desc}\n")
+    headers = ["Impl"] + list(skews.values())
+    print("| " + " | ".join(headers) + " |")
+    print("| " + " | ".join("---" for _ in headers) + " |")
+    for row in rows:
+        print("| " + " | ".join(row.get(h, "-") for h in headers) + " |")
+    print()
+
+for group, desc in memory_groups.items():
+    frames = {}
+    for impl in implementations:
+        fn = os.path.join(data_dir, f"{impl}_{group}_mem.csv")
+        if os.path.exists(fn):
+            frames[impl] = pd.read_csv(fn)
+    if not frames:
+        continue
+
+    plt.figure(figsize=(6,4))
+    for impl, df in frames.items():
+        plt.plot(df['entries'].to_numpy(), df['bytes_per_entry'].to_numpy(), label=impl)
+        plt.plot(df['entries'].to_numpy(), df['peak_bytes_per_entry'].to_numpy(),
+                 label=f"{impl} peak", linestyle='--')
+    plt.xlabel(r'Entries')
+    plt.ylabel(r'Allocated bytes per entry')
+    plt.title(f"Memory per entry ({desc})")
+    plt.legend(title="Impl")
+    plt.tight_layout()
+    plt.savefig(f"memory_{group}.png", dpi=300)
+    plt.close()
+
+    print(f"## Memory `{group}`: {desc}\n")
+    headers = ["Impl", "Entries", "Bytes/entry", "Peak bytes/entry", "RSS growth (MiB)"]
+    print("| " + " | ".join(headers) + " |")
+    print("| " + " | ".join("---" for _ in headers) + " |")
+    for impl, df in frames.items():
+        last = df.iloc[-1]
+        print(f"| {impl} | {int(last['entries'])} | {last['bytes_per_entry']:.2f} | "
+              f"{last['peak_bytes_per_entry']:.2f} | {last['rss_growth_kb'] / 1024:.1f} |")
+    print()
+
+for group, desc in memory_groups.items():
+    frames = {}
+    for impl in implementations:
+        fn = os.path.join(data_dir, f"{impl}_{group}_grow.csv")
+        if os.path.exists(fn):
+            frames[impl] = pd.read_csv(fn)
+    if not frames:
+        continue
+
+    plt.figure(figsize=(6,4))
+    for impl, df in frames.items():
+        plt.plot(df['entries'].to_numpy(), df['ns'].to_numpy() / 1e6, marker='o', label=impl)
+    plt.xscale('log', base=2)
+    plt.yscale('log')
+    plt.xlabel(r'Entries at resize')
+    plt.ylabel(r'Resize time (ms)')
+    plt.title(f"Cost of each resize ({desc})")
+    plt.legend(title="Impl")
+    plt.tight_layout()
+    plt.savefig(f"grow_{group}.png", dpi=300)
+    plt.close()
+
+    print(f"## Resizes `{group}`: {desc}\n")
+    headers = ["Impl", "Capacity", "Entries", "Time (ms)", "Allocated (MiB)", "Peak (MiB)", "Page faults"]
+    print("| " + " | ".join(headers) + " |")
+    print("| " + " | ".join("---" for _ in headers) + " |")
+    for impl, df in frames.items():
+        for _, r in df.iterrows():
+            print(f"| {impl} | {r['cap_before']} -> {r['cap_after']} | {r['entries']} | "
+                  f"{r['ns'] / 1e6:.3f} | {r['alloc_bytes'] / 2**20:.2f} | "
+                  f"{r['peak_bytes'] / 2**20:.2f} | {r['minflt']} |")
+    print()
+
+fn = os.path.join(data_dir, "threads_k8v8.csv")
+if os.path.exists(fn):
+    df = pd.read_csv(fn)
+    modes = list(dict.fromkeys(df['mode']))
+
+    plt.figure(figsize=(6,4))
+    for mode in modes:
+        df_m = df[df['mode'] == mode]
+        plt.plot(df_m['threads'].to_numpy(), df_m['ops_per_sec'].to_numpy() / 1e6,
+                 marker='o', label=mode)
+    plt.xscale('log', base=2)
+    plt.xlabel(r'Threads')
+    plt.ylabel(r'Aggregate throughput (Mops/s)')
+    plt.title("swiss scaling (8 byte key / 8 byte value)")
+    plt.legend(title="Mode")
+    plt.tight_layout()
+    plt.savefig("threads_k8v8.png", dpi=300)
+    plt.close()
+
+    print("## Thread scaling: swiss, 8 byte key / 8 byte value\n")
+    threads = sorted(set(df['threads']))
+    headers = ["Mode"] + [f"{t} (Mops/s)" for t in threads]
+    print("| " + " | ".join(headers) + " |")
+    print("| " + " | ".join("---" for _ in headers) + " |")
+    for mode in modes:
+        df_m = df[df['mode'] == mode].set_index('threads')
+        print("| " + " | ".join([mode] + [f"{df_m.loc[t, 'ops_per_sec'] / 1e6:.2f}" if t in df_m.index else "-"
+                                          for t in threads]) + " |")
+    print()
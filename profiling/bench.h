@@ -0,0 +1,979 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Shared by the C and C++ drivers so every implementation sees the same keys,
+// values and operation sequence for a given set of options.
+
+enum { OP_INSERT, OP_LOOKUP, OP_DELETE, OP_MISS, OP_MIXED, OP_COUNT };
+static const char *const bench_op_names[OP_COUNT] = { "Insert", "Lookup", "Delete", "LookupMiss", "Mixed" };
+
+#define BENCH_MAX_FILLS 16
+
+typedef struct {
+    uint64_t key_size, val_size, n;
+    int reserve;
+    // insert:lookup:delete weights for an interleaved run, all zero = phased
+    uint32_t mix[3];
+    uint64_t seed;
+    // ops per timed batch in throughput mode, 0 = sampled per-op latency
+    uint64_t batch;
+    // where to write the per-op latency histograms, if anywhere
+    const char *hist_path;
+    // percentage of lookups that target keys which were never inserted
+    uint32_t miss_pct;
+    // percentage of the inserted keys deleted before the lookup phase
+    uint32_t churn_pct;
+    // fill levels (percent of n) at which the sweep workload probes
+    uint32_t fills[BENCH_MAX_FILLS], nfills;
+    // lookup/delete key choice: Zipf exponent, or width of a sliding window
+    // of recently used keys; both zero = uniform
+    double zipf;
+    uint64_t window;
+    // insert only, reporting memory use instead of timings
+    int memory;
+    // where to write per-phase hardware counters, if anywhere
+    const char *perf_path;
+    // where to write a JSON summary of the run, if anywhere
+    const char *json_path;
+    // insert only, reporting every resize instead of the phases
+    int grow;
+} bench_opts_t;
+
+typedef struct {
+    char *keys, *vals;
+    uint32_t *lookup, *erase;
+    uint8_t *ops;
+} bench_data_t;
+
+typedef struct { long ns; uint64_t ops, count; } bench_sample_t;
+
+// Log-linear (HDR style) histogram of ticks: exact below 2^(SUB_BITS+1),
+// then 2^SUB_BITS buckets per power of two, i.e. ~3% relative error.
+#define BENCH_HIST_SUB_BITS 5
+#define BENCH_HIST_SUB (1u << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS ((64 - BENCH_HIST_SUB_BITS) * BENCH_HIST_SUB)
+
+typedef struct {
+    uint64_t counts[BENCH_HIST_BUCKETS];
+    uint64_t total, max;
+} bench_hist_t;
+
+typedef struct {
+    uint32_t fill;
+    double load;
+    int op;
+    uint64_t ops;
+    long ns;
+} bench_sweep_t;
+
+#define BENCH_MEM_STEPS 10
+
+typedef struct {
+    uint64_t entries, live, peak;
+    long maxrss_kb;
+} bench_memrow_t;
+
+enum {
+    PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES,
+    PERF_DTLB_MISSES, PERF_BRANCH_MISSES, PERF_PAGE_FAULTS, PERF_COUNT
+};
+static const char *const bench_perf_names[PERF_COUNT] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses",
+    "dtlb_misses", "branch_misses", "page_faults"
+};
+
+// One perf_event fd per counter (-1 where the kernel or CPU refuses it) and
+// the totals accumulated per phase.
+typedef struct {
+    int fd[PERF_COUNT];
+    uint64_t value[OP_COUNT][PERF_COUNT];
+    uint64_t ops[OP_COUNT];
+} bench_perf_t;
+
+// 2^64 caps the number of doublings any table can do
+#define BENCH_MAX_GROWS 64
+
+typedef struct {
+    uint64_t cap_before, cap_after, entries;
+    long ns;
+    uint64_t alloc_bytes, peak_bytes;
+    long minflt;
+} bench_growrow_t;
+
+typedef struct {
+    bench_sample_t *items[OP_COUNT];
+    uint64_t count[OP_COUNT];
+    bench_hist_t hist[OP_COUNT];
+    bench_sweep_t sweep[2 * BENCH_MAX_FILLS];
+    uint64_t nsweep;
+    bench_memrow_t mem[BENCH_MEM_STEPS];
+    uint64_t nmem;
+    long base_rss_kb;
+    bench_growrow_t grows[BENCH_MAX_GROWS];
+    uint64_t ngrows;
+    bench_perf_t perf;
+    int throughput;
+} bench_samples_t;
+
+#define BENCH_SAMPLE_EVERY 100
+// Keys [0, n) are inserted; when misses are needed, keys [n, 2n) never are.
+#define BENCH_KEY(o, d, i) ((d)->keys + (uint64_t)(i) * (o)->key_size)
+#define BENCH_VAL(o, d, i) ((d)->vals + (uint64_t)(i) * (o)->val_size)
+
+static uint64_t xorshift64star_state = 88172645463325252ull;
+static inline uint64_t xor64_rand(void) {
+    uint64_t x = xorshift64star_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    xorshift64star_state = x;
+    return x * 2685821657736338717ull;
+}
+
+static inline void random_bytes(char *buf, uint64_t length) {
+    for (uint64_t i = 0; i < length; i += 8) {
+        uint64_t r = xor64_rand();
+        memcpy(buf + i, &r, length - i < 8 ? length - i : 8);
+    }
+}
+
+static inline double rand01(void) {
+    return (double)(xor64_rand() >> 11) * 0x1.0p-53;
+}
+
+// Zipf over ranks [1, n] with exponent s by rejection-inversion (Hörmann and
+// Derflinger 1996), which needs no O(n) table and works for any s > 0.
+typedef struct {
+    uint64_t n;
+    double s, h_x1, h_n, s_adj;
+} bench_zipf_t;
+
+static inline double zipf_helper1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static inline double zipf_helper2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+static inline double zipf_h(const bench_zipf_t *z, double x) {
+    return exp(-z->s * log(x));
+}
+
+static inline double zipf_h_integral(const bench_zipf_t *z, double x) {
+    double lx = log(x);
+    return zipf_helper2((1 - z->s) * lx) * lx;
+}
+
+static inline double zipf_h_integral_inv(const bench_zipf_t *z, double x) {
+    double t = x * (1 - z->s);
+    if (t < -1) t = -1;
+    return exp(zipf_helper1(t) * x);
+}
+
+static inline void zipf_init(bench_zipf_t *z, uint64_t n, double s) {
+    z->n = n;
+    z->s = s;
+    z->h_x1 = zipf_h_integral(z, 1.5) - 1;
+    z->h_n = zipf_h_integral(z, (double)n + 0.5);
+    z->s_adj = 2 - zipf_h_integral_inv(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+// Returns a rank in [0, n), rank 0 being the hottest.
+static inline uint64_t zipf_next(const bench_zipf_t *z) {
+    for (;;) {
+        double u = z->h_n + rand01() * (z->h_x1 - z->h_n);
+        double x = zipf_h_integral_inv(z, u);
+        double k = floor(x + 0.5);
+        if (k < 1) k = 1;
+        else if (k > (double)z->n) k = (double)z->n;
+        if (k - x <= z->s_adj || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k))
+            return (uint64_t)k - 1;
+    }
+}
+
+static inline void bench_escape(const void *p) {
+    __asm__ volatile("" :: "g"(p) : "memory");
+}
+
+static inline long ns_diff(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec)*1000000000L
+         + (b->tv_nsec - a->tv_nsec);
+}
+
+// Operations are timed with serialised rdtsc/rdtscp; the tick rate and the
+// cost of an empty start/stop pair are measured once by bench_calibrate.
+static double bench_ns_per_tick = 1.0;
+static uint64_t bench_tick_overhead = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t bench_start(void) {
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+}
+
+static inline uint64_t bench_stop(void) {
+    unsigned aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+}
+#else
+static inline uint64_t bench_start(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+#define bench_stop bench_start
+#endif
+
+static inline void bench_calibrate(void) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = bench_start();
+    do clock_gettime(CLOCK_MONOTONIC, &t1); while (ns_diff(&t0, &t1) < 50000000L);
+    uint64_t c1 = bench_stop();
+    bench_ns_per_tick = (double)ns_diff(&t0, &t1) / (double)(c1 - c0);
+
+    bench_tick_overhead = UINT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t a = bench_start();
+        uint64_t b = bench_stop();
+        if (b - a < bench_tick_overhead) bench_tick_overhead = b - a;
+    }
+}
+
+static inline long bench_ticks_to_ns(uint64_t ticks) {
+    return (long)((double)ticks * bench_ns_per_tick);
+}
+
+static inline uint64_t bench_hist_index(uint64_t v) {
+    if (v < 2 * BENCH_HIST_SUB) return v;
+    int shift = 63 - __builtin_clzll(v) - BENCH_HIST_SUB_BITS;
+    uint64_t idx = (uint64_t)shift * BENCH_HIST_SUB + (v >> shift);
+    // deltas of 2^63 ticks and up only come from a TSC that went backwards
+    return idx < BENCH_HIST_BUCKETS ? idx : BENCH_HIST_BUCKETS - 1;
+}
+
+static inline uint64_t bench_hist_lower(uint64_t idx) {
+    if (idx < 2 * BENCH_HIST_SUB) return idx;
+    uint64_t shift = idx / BENCH_HIST_SUB - 1;
+    return (idx % BENCH_HIST_SUB + BENCH_HIST_SUB) << shift;
+}
+
+static inline void bench_hist_add(bench_hist_t *h, uint64_t ticks) {
+    h->counts[bench_hist_index(ticks)]++;
+    h->total++;
+    if (ticks > h->max) h->max = ticks;
+}
+
+// Bytes the map under test has asked its allocator for. Each driver routes
+// its map's allocations through bench_mem_alloc/bench_mem_free, so peak also
+// catches the moment a grow holds both the old and the new arrays.
+typedef struct { uint64_t live, peak, allocs; } bench_mem_t;
+static bench_mem_t bench_mem;
+
+static inline void bench_mem_alloc(uint64_t n) {
+    bench_mem.live += n;
+    bench_mem.allocs++;
+    if (bench_mem.live > bench_mem.peak) bench_mem.peak = bench_mem.live;
+}
+
+static inline void bench_mem_free(uint64_t n) {
+    bench_mem.live -= n;
+}
+
+static inline long bench_maxrss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static inline long bench_minflt(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+#ifdef __linux__
+static inline int bench_perf_open(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        // perf_event_paranoid >= 2 only allows user space counting
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    return fd;
+}
+
+#define BENCH_PERF_CACHE(c, miss) \
+    ((c) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((miss) << 16))
+
+static inline void bench_perf_init(bench_perf_t *p) {
+    const uint32_t types[PERF_COUNT] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE
+    };
+    const uint64_t configs[PERF_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        BENCH_PERF_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS),
+        PERF_COUNT_HW_CACHE_MISSES,
+        BENCH_PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS),
+        PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_SW_PAGE_FAULTS
+    };
+    memset(p, 0, sizeof(*p));
+    int opened = 0;
+    for (int i = 0; i < PERF_COUNT; i++) {
+        p->fd[i] = bench_perf_open(types[i], configs[i]);
+        opened += p->fd[i] >= 0;
+    }
+    if (opened < PERF_COUNT)
+        fprintf(stderr, "bench: %d of %d perf counters unavailable, left blank\n",
+                PERF_COUNT - opened, PERF_COUNT);
+}
+
+static inline void bench_perf_begin(bench_perf_t *p) {
+    for (int i = 0; i < PERF_COUNT; i++)
+        if (p->fd[i] >= 0) {
+            ioctl(p->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(p->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+// Counters that were multiplexed with others are scaled up by the fraction
+// of the phase they actually ran for.
+static inline void bench_perf_end(bench_perf_t *p, int op, uint64_t ops) {
+    for (int i = 0; i < PERF_COUNT; i++)
+        if (p->fd[i] >= 0)
+            ioctl(p->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (int i = 0; i < PERF_COUNT; i++) {
+        uint64_t r[3];
+        if (p->fd[i] < 0 || read(p->fd[i], r, sizeof(r)) != sizeof(r)) continue;
+        p->value[op][i] += r[2] ? (uint64_t)((double)r[0] * (double)r[1] / (double)r[2]) : 0;
+    }
+    p->ops[op] += ops;
+}
+
+static inline void bench_perf_close(bench_perf_t *p) {
+    for (int i = 0; i < PERF_COUNT; i++)
+        if (p->fd[i] >= 0) close(p->fd[i]);
+}
+#else
+static inline void bench_perf_init(bench_perf_t *p) {
+    memset(p, 0, sizeof(*p));
+    for (int i = 0; i < PERF_COUNT; i++) p->fd[i] = -1;
+    fprintf(stderr, "bench: perf counters need Linux, left blank\n");
+}
+static inline void bench_perf_begin(bench_perf_t *p) { (void)p; }
+static inline void bench_perf_end(bench_perf_t *p, int op, uint64_t ops) { p->ops[op] += ops; }
+static inline void bench_perf_close(bench_perf_t *p) { (void)p; }
+#endif
+
+// Programs with options of their own set these before calling bench_parse:
+// extra getopt letters, their usage lines, and a handler that returns
+// non-zero for an option it does not accept.
+static const char *bench_extra_opts = "";
+static const char *bench_extra_usage = "";
+static int (*bench_extra_opt)(int c, const char *arg) = NULL;
+
+static inline void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-k key_size] [-v val_size] [-n count] [-r] [-m I:L:D] [-t batch] [-H file]\n"
+            "          [-x miss%%] [-D delete%%] [-L fill%%,...]\n"
+            "          [-z theta | -w window] [-M] [-G] [-P file] [-J file] [-s seed]\n"
+            "  -k  key size in bytes (default 8)\n"
+            "  -v  value size in bytes (default 8)\n"
+            "  -n  number of keys / operations per phase (default 1000000)\n"
+            "  -r  pre-reserve the map for n keys\n"
+            "  -m  interleave insert:lookup:delete with these weights instead of\n"
+            "      running each phase over all n keys\n"
+            "  -t  throughput mode: time batches of this many operations and\n"
+            "      report ns/op and ops/sec instead of sampled per-op latency\n"
+            "  -H  write per-op latency histograms (every op, not just the\n"
+            "      sampled ones) to this CSV file\n"
+            "  -x  percentage of lookups that miss (default 0)\n"
+            "  -D  delete this percentage of the keys before the lookup phase,\n"
+            "      leaving tombstones behind; lookup hits go to the survivors\n"
+            "  -L  sweep: fill the map to each of these percentages of n and\n"
+            "      time hit and miss lookups there instead of the phases\n"
+            "  -z  draw lookup/delete keys from Zipf(theta) instead of uniformly\n"
+            "  -w  draw lookup/delete keys from a window of this many keys that\n"
+            "      slides across the key set over the course of the phase\n"
+            "  -M  memory: insert n keys and report allocated bytes, bytes per\n"
+            "      entry and peak RSS at every tenth of the way\n"
+            "  -G  grow: insert n keys and report each resize of the table\n"
+            "      (time, bytes allocated, peak bytes, page faults) on its own\n"
+            "  -P  write per-phase hardware counters (cycles, instructions,\n"
+            "      cache, dTLB and branch misses, page faults) per op to this\n"
+            "      CSV file; best combined with -t so the clock reads between\n"
+            "      ops stay out of the counts\n"
+            "  -J  also write a JSON summary of the run to this file\n"
+            "  -s  RNG seed\n%s", prog, bench_extra_usage);
+    exit(2);
+}
+
+static inline bench_opts_t bench_parse(int argc, char **argv) {
+    bench_opts_t o;
+    memset(&o, 0, sizeof(o));
+    o.key_size = 8;
+    o.val_size = 8;
+    o.n = 1000000;
+    o.seed = xorshift64star_state;
+
+    char optstring[64];
+    snprintf(optstring, sizeof(optstring), "k:v:n:rm:t:H:x:D:L:z:w:MGP:J:s:h%s", bench_extra_opts);
+    int c;
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+        switch (c) {
+        case 'k': o.key_size = strtoull(optarg, NULL, 0); break;
+        case 'v': o.val_size = strtoull(optarg, NULL, 0); break;
+        case 'n': o.n = strtoull(optarg, NULL, 0); break;
+        case 'r': o.reserve = 1; break;
+        case 'm':
+            if (sscanf(optarg, "%u:%u:%u", &o.mix[0], &o.mix[1], &o.mix[2]) != 3)
+                bench_usage(argv[0]);
+            break;
+        case 't': o.batch = strtoull(optarg, NULL, 0); break;
+        case 'H': o.hist_path = optarg; break;
+        case 'x': o.miss_pct = strtoul(optarg, NULL, 0); break;
+        case 'D': o.churn_pct = strtoul(optarg, NULL, 0); break;
+        case 'L':
+            for (char *f = strtok(optarg, ","); f; f = strtok(NULL, ",")) {
+                if (o.nfills == BENCH_MAX_FILLS) bench_usage(argv[0]);
+                o.fills[o.nfills] = strtoul(f, NULL, 0);
+                if (!o.fills[o.nfills] || o.fills[o.nfills] > 100) bench_usage(argv[0]);
+                o.nfills++;
+            }
+            break;
+        case 'z': o.zipf = strtod(optarg, NULL); break;
+        case 'w': o.window = strtoull(optarg, NULL, 0); break;
+        case 'M': o.memory = 1; break;
+        case 'G': o.grow = 1; break;
+        case 'P': o.perf_path = optarg; break;
+        case 'J': o.json_path = optarg; break;
+        case 's': o.seed = strtoull(optarg, NULL, 0); break;
+        default:
+            if (!bench_extra_opt || bench_extra_opt(c, optarg))
+                bench_usage(argv[0]);
+        }
+    }
+    if (!o.key_size || !o.val_size || !o.n || o.n > UINT32_MAX / 2
+        || o.miss_pct > 100 || o.churn_pct >= 100
+        || o.zipf < 0 || (o.zipf > 0 && o.window))
+        bench_usage(argv[0]);
+    return o;
+}
+
+static inline uint64_t bench_nkeys(const bench_opts_t *o) {
+    return o->miss_pct || o->nfills ? 2 * o->n : o->n;
+}
+
+static inline uint64_t bench_churned(const bench_opts_t *o) {
+    return o->n * o->churn_pct / 100;
+}
+
+// Picks the i-th of n accesses over keys [0, range) per the -z/-w options.
+static inline uint64_t bench_pick(const bench_opts_t *o, const bench_zipf_t *z, uint64_t i, uint64_t range) {
+    if (o->zipf > 0)
+        return zipf_next(z);
+    if (o->window) {
+        uint64_t w = o->window < range ? o->window : range;
+        return (i * (range - w) / o->n + xor64_rand() % w) % range;
+    }
+    return xor64_rand() % range;
+}
+
+static inline void bench_prepare(const bench_opts_t *o, bench_data_t *d) {
+    xorshift64star_state = o->seed ? o->seed : 88172645463325252ull;
+    d->keys = (char*)malloc(bench_nkeys(o) * o->key_size);
+    d->vals = (char*)malloc(o->n * o->val_size);
+    d->lookup = (uint32_t*)malloc(sizeof(*d->lookup) * o->n);
+    d->erase = (uint32_t*)malloc(sizeof(*d->erase) * o->n);
+    d->ops = (uint8_t*)malloc(o->n);
+    if (!d->keys || !d->vals || !d->lookup || !d->erase || !d->ops) {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < o->n; i++) {
+        random_bytes(BENCH_KEY(o, d, i), o->key_size);
+        random_bytes(BENCH_VAL(o, d, i), o->val_size);
+    }
+    for (uint64_t i = o->n; i < bench_nkeys(o); i++)
+        random_bytes(BENCH_KEY(o, d, i), o->key_size);
+
+    uint32_t total = o->mix[0] + o->mix[1] + o->mix[2];
+    uint64_t dead = bench_churned(o);
+    bench_zipf_t zl, ze;
+    if (o->zipf > 0) {
+        zipf_init(&zl, o->n - dead, o->zipf);
+        zipf_init(&ze, o->n, o->zipf);
+    }
+    for (uint64_t i = 0; i < o->n; i++) {
+        if (o->miss_pct && xor64_rand() % 100 < o->miss_pct)
+            d->lookup[i] = o->n + xor64_rand() % o->n;
+        else
+            d->lookup[i] = dead + bench_pick(o, &zl, i, o->n - dead);
+        d->erase[i] = bench_pick(o, &ze, i, o->n);
+        if (total) {
+            uint32_t r = xor64_rand() % total;
+            d->ops[i] = r < o->mix[0] ? OP_INSERT
+                      : r < o->mix[0] + o->mix[1] ? OP_LOOKUP : OP_DELETE;
+        }
+    }
+}
+
+static inline void bench_release(bench_data_t *d) {
+    free(d->keys);
+    free(d->vals);
+    free(d->lookup);
+    free(d->erase);
+    free(d->ops);
+}
+
+static inline void bench_samples_init(bench_samples_t *s, const bench_opts_t *o) {
+    uint64_t every = o->batch ? o->batch : BENCH_SAMPLE_EVERY;
+    for (int op = 0; op < OP_COUNT; op++) {
+        s->items[op] = (bench_sample_t*)malloc(sizeof(bench_sample_t) * (o->n / every + 1));
+        s->count[op] = 0;
+    }
+    memset(s->hist, 0, sizeof(s->hist));
+    s->nsweep = 0;
+    s->nmem = 0;
+    s->ngrows = 0;
+    s->base_rss_kb = bench_maxrss_kb();
+    for (int i = 0; i < PERF_COUNT; i++)
+        s->perf.fd[i] = -1;
+    if (o->perf_path)
+        bench_perf_init(&s->perf);
+    s->throughput = o->batch != 0;
+    bench_calibrate();
+}
+
+static inline void bench_record(bench_samples_t *s, int op, long ns, uint64_t ops, uint64_t count) {
+    bench_sample_t *smp = &s->items[op][s->count[op]++];
+    smp->ns = ns;
+    smp->ops = ops;
+    smp->count = count;
+}
+
+static inline int bench_hist_write(const bench_samples_t *s, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "operation,lo_ns,hi_ns,count\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const bench_hist_t *h = &s->hist[op];
+        for (uint64_t i = 0; i < BENCH_HIST_BUCKETS; i++) {
+            if (!h->counts[i]) continue;
+            uint64_t hi = bench_hist_lower(i + 1) - 1;
+            if (hi > h->max) hi = h->max;
+            fprintf(f, "%s,%ld,%ld,%lu\n", bench_op_names[op],
+                    bench_ticks_to_ns(bench_hist_lower(i)), bench_ticks_to_ns(hi),
+                    (unsigned long)h->counts[i]);
+        }
+    }
+    return fclose(f);
+}
+
+static inline void bench_sweep_record(bench_samples_t *s, uint32_t fill, double load, int op, uint64_t ops, uint64_t ticks) {
+    bench_sweep_t *r = &s->sweep[s->nsweep++];
+    r->fill = fill;
+    r->load = load;
+    r->op = op;
+    r->ops = ops;
+    r->ns = bench_ticks_to_ns(ticks);
+}
+
+static inline int bench_perf_write(const bench_perf_t *p, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "operation,ops");
+    for (int i = 0; i < PERF_COUNT; i++)
+        fprintf(f, ",%s_per_op", bench_perf_names[i]);
+    fprintf(f, "\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (!p->ops[op]) continue;
+        fprintf(f, "%s,%lu", bench_op_names[op], (unsigned long)p->ops[op]);
+        for (int i = 0; i < PERF_COUNT; i++) {
+            if (p->fd[i] < 0) fprintf(f, ",");
+            else fprintf(f, ",%.4f", (double)p->value[op][i] / (double)p->ops[op]);
+        }
+        fprintf(f, "\n");
+    }
+    return fclose(f);
+}
+
+// Upper edge of the bucket holding quantile q of a histogram, in ticks.
+static inline uint64_t bench_hist_quantile(const bench_hist_t *h, double q) {
+    uint64_t want = (uint64_t)ceil(q * (double)h->total), seen = 0;
+    for (uint64_t i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (h->counts[i] && seen >= want) {
+            uint64_t hi = bench_hist_lower(i + 1) - 1;
+            return hi < h->max ? hi : h->max;
+        }
+    }
+    return h->max;
+}
+
+// One object per run for scripts: the options, then per operation either
+// batch totals (throughput mode) or the histogram summary, and the fill
+// sweep, resizes or final memory row when those modes ran.
+static inline int bench_json_write(const bench_samples_t *s, const bench_opts_t *o, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "{\"key_size\": %lu, \"val_size\": %lu, \"n\": %lu, \"reserve\": %d, "
+            "\"mix\": [%u, %u, %u], \"batch\": %lu, \"miss_pct\": %u, \"churn_pct\": %u, "
+            "\"zipf\": %g, \"window\": %lu, \"seed\": %lu,\n \"results\": [",
+            (unsigned long)o->key_size, (unsigned long)o->val_size, (unsigned long)o->n, o->reserve,
+            o->mix[0], o->mix[1], o->mix[2], (unsigned long)o->batch, o->miss_pct, o->churn_pct,
+            o->zipf, (unsigned long)o->window, (unsigned long)o->seed);
+    const char *sep = "";
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (s->throughput) {
+            uint64_t ops = 0;
+            long ns = 0;
+            for (uint64_t i = 0; i < s->count[op]; i++) {
+                ops += s->items[op][i].ops;
+                ns += s->items[op][i].ns;
+            }
+            if (!ops) continue;
+            fprintf(f, "%s\n  {\"operation\": \"%s\", \"ops\": %lu, \"ns\": %ld, \"ns_per_op\": %.4f}",
+                    sep, bench_op_names[op], (unsigned long)ops, ns, (double)ns / (double)ops);
+        } else {
+            const bench_hist_t *h = &s->hist[op];
+            if (!h->total) continue;
+            double sum = 0;
+            for (uint64_t i = 0; i < BENCH_HIST_BUCKETS; i++)
+                sum += (double)h->counts[i] * (double)bench_hist_lower(i);
+            fprintf(f, "%s\n  {\"operation\": \"%s\", \"ops\": %lu, \"ns_per_op\": %.4f, "
+                    "\"p50_ns\": %ld, \"p90_ns\": %ld, \"p99_ns\": %ld, \"p999_ns\": %ld, \"max_ns\": %ld}",
+                    sep, bench_op_names[op], (unsigned long)h->total,
+                    sum * bench_ns_per_tick / (double)h->total,
+                    bench_ticks_to_ns(bench_hist_quantile(h, 0.5)),
+                    bench_ticks_to_ns(bench_hist_quantile(h, 0.9)),
+                    bench_ticks_to_ns(bench_hist_quantile(h, 0.99)),
+                    bench_ticks_to_ns(bench_hist_quantile(h, 0.999)),
+                    bench_ticks_to_ns(h->max));
+        }
+        sep = ",";
+    }
+    fprintf(f, "\n ]");
+    if (o->nfills) {
+        fprintf(f, ",\n \"sweep\": [");
+        for (uint64_t i = 0; i < s->nsweep; i++)
+            fprintf(f, "%s\n  {\"fill\": %u, \"load\": %.4f, \"operation\": \"%s\", \"ns_per_op\": %.4f}",
+                    i ? "," : "", s->sweep[i].fill, s->sweep[i].load, bench_op_names[s->sweep[i].op],
+                    (double)s->sweep[i].ns / (double)s->sweep[i].ops);
+        fprintf(f, "\n ]");
+    }
+    if (o->grow) {
+        fprintf(f, ",\n \"grows\": [");
+        for (uint64_t i = 0; i < s->ngrows; i++)
+            fprintf(f, "%s\n  {\"cap_before\": %lu, \"cap_after\": %lu, \"entries\": %lu, \"ns\": %ld, "
+                    "\"alloc_bytes\": %lu, \"peak_bytes\": %lu, \"minflt\": %ld}",
+                    i ? "," : "", (unsigned long)s->grows[i].cap_before, (unsigned long)s->grows[i].cap_after,
+                    (unsigned long)s->grows[i].entries, s->grows[i].ns, (unsigned long)s->grows[i].alloc_bytes,
+                    (unsigned long)s->grows[i].peak_bytes, s->grows[i].minflt);
+        fprintf(f, "\n ]");
+    }
+    if (o->memory && s->nmem) {
+        const bench_memrow_t *r = &s->mem[s->nmem - 1];
+        fprintf(f, ",\n \"memory\": {\"entries\": %lu, \"bytes_per_entry\": %.2f, "
+                "\"peak_bytes_per_entry\": %.2f, \"rss_growth_kb\": %ld}",
+                (unsigned long)r->entries, (double)r->live / (double)r->entries,
+                (double)r->peak / (double)r->entries, r->maxrss_kb - s->base_rss_kb);
+    }
+    fprintf(f, "\n}\n");
+    return fclose(f);
+}
+
+static inline void bench_mem_record(bench_samples_t *s, uint64_t entries) {
+    bench_memrow_t *r = &s->mem[s->nmem++];
+    r->entries = entries;
+    r->live = bench_mem.live;
+    r->peak = bench_mem.peak;
+    r->maxrss_kb = bench_maxrss_kb();
+}
+
+static inline void bench_grow_record(bench_samples_t *s, uint64_t cap_before, uint64_t cap_after,
+                              uint64_t entries, uint64_t ticks, uint64_t alloc_bytes, long minflt) {
+    if (s->ngrows == BENCH_MAX_GROWS) return;
+    bench_growrow_t *r = &s->grows[s->ngrows++];
+    r->cap_before = cap_before;
+    r->cap_after = cap_after;
+    r->entries = entries;
+    r->ns = bench_ticks_to_ns(ticks);
+    r->alloc_bytes = alloc_bytes;
+    r->peak_bytes = bench_mem.peak;
+    r->minflt = minflt;
+}
+
+static inline void bench_samples_print(const bench_samples_t *s, const bench_opts_t *o) {
+    if (o->perf_path)
+        bench_perf_write(&s->perf, o->perf_path);
+    if (o->json_path)
+        bench_json_write(s, o, o->json_path);
+    if (o->grow) {
+        // rehashed_bytes is the key/value payload of the live entries, which
+        // an open addressing table copies and a node based one only relinks
+        printf("cap_before,cap_after,entries,ns,rehashed_bytes,alloc_bytes,peak_bytes,minflt\n");
+        for (uint64_t i = 0; i < s->ngrows; i++) {
+            const bench_growrow_t *r = &s->grows[i];
+            printf("%lu,%lu,%lu,%ld,%lu,%lu,%lu,%ld\n", (unsigned long)r->cap_before,
+                   (unsigned long)r->cap_after, (unsigned long)r->entries, r->ns,
+                   (unsigned long)(r->entries * (o->key_size + o->val_size)),
+                   (unsigned long)r->alloc_bytes, (unsigned long)r->peak_bytes, r->minflt);
+        }
+        return;
+    }
+    if (o->memory) {
+        // RSS growth is measured against the high-water mark once the key
+        // and value arrays were generated, so it is the map's share plus
+        // whatever its allocator keeps on top of the counted bytes.
+        printf("entries,live_bytes,peak_bytes,bytes_per_entry,peak_bytes_per_entry,maxrss_kb,rss_growth_kb\n");
+        for (uint64_t i = 0; i < s->nmem; i++) {
+            const bench_memrow_t *r = &s->mem[i];
+            printf("%lu,%lu,%lu,%.2f,%.2f,%ld,%ld\n", (unsigned long)r->entries,
+                   (unsigned long)r->live, (unsigned long)r->peak,
+                   (double)r->live / (double)r->entries, (double)r->peak / (double)r->entries,
+                   r->maxrss_kb, r->maxrss_kb - s->base_rss_kb);
+        }
+        return;
+    }
+    if (o->nfills) {
+        printf("fill,load,operation,ops,ns_per_op\n");
+        for (uint64_t i = 0; i < s->nsweep; i++)
+            printf("%u,%.4f,%s,%lu,%.3f\n", s->sweep[i].fill, s->sweep[i].load,
+                   bench_op_names[s->sweep[i].op], (unsigned long)s->sweep[i].ops,
+                   (double)s->sweep[i].ns / (double)s->sweep[i].ops);
+        return;
+    }
+    if (o->hist_path && !s->throughput)
+        bench_hist_write(s, o->hist_path);
+
+    if (s->throughput) {
+        printf("operation,ops,ns,ns_per_op,ops_per_sec,count\n");
+        for (int op = 0; op < OP_COUNT; op++)
+            for (uint64_t i = 0; i < s->count[op]; i++) {
+                const bench_sample_t *smp = &s->items[op][i];
+                double ns = smp->ns > 0 ? (double)smp->ns : 1.0;
+                printf("%s,%lu,%ld,%.3f,%.0f,%lu\n", bench_op_names[op],
+                       (unsigned long)smp->ops, smp->ns, ns / (double)smp->ops,
+                       (double)smp->ops * 1e9 / ns, (unsigned long)smp->count);
+            }
+        return;
+    }
+    printf("operation,avg_ns,count\n");
+    for (int op = 0; op < OP_COUNT; op++)
+        for (uint64_t i = 0; i < s->count[op]; i++)
+            printf("%s,%ld,%lu\n", bench_op_names[op], s->items[op][i].ns,
+                   (unsigned long)s->items[op][i].count);
+}
+
+static inline void bench_samples_release(bench_samples_t *s) {
+    for (int op = 0; op < OP_COUNT; op++)
+        free(s->items[op]);
+    bench_perf_close(&s->perf);
+}
+
+// Times one operation into the histogram and keeps every
+// BENCH_SAMPLE_EVERY-th sample for the latency-over-size plots.
+#define BENCH_TIME(s, op, i, SIZE, STMT)                                       \
+    do {                                                                       \
+        uint64_t _t0 = bench_start();                                          \
+        STMT;                                                                  \
+        uint64_t _t1 = bench_stop() - _t0;                                     \
+        _t1 = _t1 > bench_tick_overhead ? _t1 - bench_tick_overhead : 0;       \
+        bench_hist_add(&(s)->hist[op], _t1);                                   \
+        if ((i) % BENCH_SAMPLE_EVERY == 0)                                     \
+            bench_record(s, op, bench_ticks_to_ns(_t1), 1, (SIZE));            \
+    } while (0)
+
+// Hits and misses are recorded separately so the miss path, which has to
+// scan on to a group with an EMPTY slot, gets its own histogram.
+#define BENCH_LOOKUP_OP(o, d, i) ((d)->lookup[i] >= (o)->n ? OP_MISS : OP_LOOKUP)
+
+// Runs STMT for _i in [0, n), either timing each call as op (which may
+// depend on _i) or, in throughput mode, timing whole batches as bop so the
+// clock reads are amortised over o->batch operations and do not stall the
+// pipeline between them.
+#define BENCH_LOOP(o, s, op, bop, SIZE, STMT)                                  \
+    do {                                                                       \
+        if ((o)->batch) {                                                      \
+            for (uint64_t _b = 0; _b < (o)->n; _b += (o)->batch) {             \
+                uint64_t _e = _b + (o)->batch < (o)->n ? _b + (o)->batch : (o)->n; \
+                uint64_t _t0 = bench_start();                                  \
+                for (uint64_t _i = _b; _i < _e; _i++) { STMT; }                \
+                uint64_t _t1 = bench_stop();                                   \
+                bench_record(s, bop, bench_ticks_to_ns(_t1 - _t0), _e - _b, (SIZE)); \
+            }                                                                  \
+        } else {                                                               \
+            for (uint64_t _i = 0; _i < (o)->n; _i++)                           \
+                BENCH_TIME(s, op, _i, SIZE, STMT);                             \
+        }                                                                      \
+    } while (0)
+
+// Fills the map in steps to each o->fills percentage of n and, at every
+// step, times n/10 lookups of present keys and n/10 of absent ones.
+#define BENCH_SWEEP(o, d, s, LOAD, PUT, GET)                                   \
+    do {                                                                       \
+        uint64_t _done = 0, _probes = (o)->n / 10 ? (o)->n / 10 : 1;           \
+        for (uint32_t _f = 0; _f < (o)->nfills; _f++) {                        \
+            uint64_t _to = (o)->n * (o)->fills[_f] / 100;                      \
+            for (; _done < _to; _done++)                                       \
+                PUT(BENCH_KEY(o, d, _done), BENCH_VAL(o, d, _done));           \
+            if (!_done) continue;                                              \
+            uint64_t _t0 = bench_start();                                      \
+            for (uint64_t _j = 0; _j < _probes; _j++)                          \
+                GET(BENCH_KEY(o, d, (d)->lookup[_j] % _done));                 \
+            uint64_t _t1 = bench_stop();                                       \
+            bench_sweep_record(s, (o)->fills[_f], (LOAD), OP_LOOKUP, _probes, _t1 - _t0); \
+            _t0 = bench_start();                                               \
+            for (uint64_t _j = 0; _j < _probes; _j++)                          \
+                GET(BENCH_KEY(o, d, (o)->n + (d)->lookup[_j] % (o)->n));       \
+            _t1 = bench_stop();                                                \
+            bench_sweep_record(s, (o)->fills[_f], (LOAD), OP_MISS, _probes, _t1 - _t0); \
+        }                                                                      \
+    } while (0)
+
+// Inserts all n keys untimed, snapshotting the memory counters at every
+// tenth of the way.
+#define BENCH_MEMORY(o, d, s, PUT)                                             \
+    do {                                                                       \
+        uint64_t _done = 0;                                                    \
+        for (uint32_t _f = 1; _f <= BENCH_MEM_STEPS; _f++) {                   \
+            uint64_t _to = (o)->n * _f / BENCH_MEM_STEPS;                      \
+            for (; _done < _to; _done++)                                       \
+                PUT(BENCH_KEY(o, d, _done), BENCH_VAL(o, d, _done));           \
+            if (_done) bench_mem_record(s, _done);                             \
+        }                                                                      \
+    } while (0)
+
+// Runs one phase of n operations between reads of the perf counters when
+// -P is given; a no-op wrapper otherwise. Interleaved runs count as one
+// Mixed phase.
+#define BENCH_PHASE(o, s, op, STMT)                                            \
+    do {                                                                       \
+        if ((o)->perf_path) bench_perf_begin(&(s)->perf);                      \
+        STMT;                                                                  \
+        if ((o)->perf_path) bench_perf_end(&(s)->perf, op, (o)->n);            \
+    } while (0)
+
+// Inserts all n keys, timing each one and keeping only those during which
+// CAP changed: the insert that triggered a resize, with the allocator
+// high-water mark and page faults taken over just that call.
+#define BENCH_GROW(o, d, s, SIZE, CAP, PUT)                                    \
+    do {                                                                       \
+        for (uint64_t _i = 0; _i < (o)->n; _i++) {                             \
+            uint64_t _cap = (CAP), _size = (SIZE), _live = bench_mem.live;     \
+            bench_mem.peak = _live;                                            \
+            long _flt = bench_minflt();                                        \
+            uint64_t _t0 = bench_start();                                      \
+            PUT(BENCH_KEY(o, d, _i), BENCH_VAL(o, d, _i));                     \
+            uint64_t _t1 = bench_stop();                                       \
+            if ((CAP) != _cap)                                                 \
+                bench_grow_record(s, _cap, (CAP), _size, _t1 - _t0,            \
+                                  bench_mem.peak - _live, bench_minflt() - _flt); \
+        }                                                                      \
+    } while (0)
+
+// Drives a map through the workload described by o. PUT(k, v), GET(k) and
+// DEL(k) are the implementation's operations on raw key/value pointers,
+// SIZE is an expression yielding its current element count, CAP its slot
+// or bucket count and LOAD its load factor. Interleaved runs in throughput
+// mode are reported as a single Mixed operation.
+#define BENCH_RUN(o, d, s, SIZE, CAP, LOAD, PUT, GET, DEL)                     \
+    do {                                                                       \
+        if ((o)->grow) {                                                       \
+            BENCH_GROW(o, d, s, SIZE, CAP, PUT);                               \
+        } else if ((o)->memory) {                                              \
+            BENCH_MEMORY(o, d, s, PUT);                                        \
+        } else if ((o)->nfills) {                                              \
+            BENCH_SWEEP(o, d, s, LOAD, PUT, GET);                              \
+        } else if (!((o)->mix[0] | (o)->mix[1] | (o)->mix[2])) {               \
+            BENCH_PHASE(o, s, OP_INSERT, BENCH_LOOP(o, s, OP_INSERT, OP_INSERT, SIZE, \
+                       PUT(BENCH_KEY(o, d, _i), BENCH_VAL(o, d, _i))));        \
+            for (uint64_t _i = 0; _i < bench_churned(o); _i++)                 \
+                DEL(BENCH_KEY(o, d, _i));                                      \
+            BENCH_PHASE(o, s, OP_LOOKUP, BENCH_LOOP(o, s, BENCH_LOOKUP_OP(o, d, _i), OP_LOOKUP, SIZE, \
+                       GET(BENCH_KEY(o, d, (d)->lookup[_i]))));                \
+            BENCH_PHASE(o, s, OP_DELETE, BENCH_LOOP(o, s, OP_DELETE, OP_DELETE, SIZE, \
+                       DEL(BENCH_KEY(o, d, (d)->erase[_i]))));                 \
+        } else if ((o)->batch) {                                               \
+            uint64_t _next = 0;                                                \
+            if ((o)->perf_path) bench_perf_begin(&(s)->perf);                  \
+            BENCH_LOOP(o, s, OP_MIXED, OP_MIXED, SIZE,                         \
+                       switch ((d)->ops[_i]) {                                 \
+                       case OP_INSERT:                                         \
+                           PUT(BENCH_KEY(o, d, _next), BENCH_VAL(o, d, _next)); \
+                           _next++;                                            \
+                           break;                                              \
+                       case OP_LOOKUP:                                         \
+                           GET(BENCH_KEY(o, d, (d)->lookup[_i]));              \
+                           break;                                              \
+                       case OP_DELETE:                                         \
+                           DEL(BENCH_KEY(o, d, (d)->erase[_i]));               \
+                           break;                                              \
+                       });                                                     \
+            if ((o)->perf_path) bench_perf_end(&(s)->perf, OP_MIXED, (o)->n);  \
+        } else {                                                               \
+            uint64_t _next = 0;                                                \
+            if ((o)->perf_path) bench_perf_begin(&(s)->perf);                  \
+            for (uint64_t _i = 0; _i < (o)->n; _i++) {                         \
+                switch ((d)->ops[_i]) {                                        \
+                case OP_INSERT:                                                \
+                    BENCH_TIME(s, OP_INSERT, _i, SIZE,                         \
+                               PUT(BENCH_KEY(o, d, _next), BENCH_VAL(o, d, _next))); \
+                    _next++;                                                   \
+                    break;                                                     \
+                case OP_LOOKUP:                                                \
+                    BENCH_TIME(s, BENCH_LOOKUP_OP(o, d, _i), _i, SIZE,         \
+                               GET(BENCH_KEY(o, d, (d)->lookup[_i])));         \
+                    break;                                                     \
+                case OP_DELETE:                                                \
+                    BENCH_TIME(s, OP_DELETE, _i, SIZE,                         \
+                               DEL(BENCH_KEY(o, d, (d)->erase[_i])));          \
+                    break;                                                     \
+                }                                                              \
+            }                                                                  \
+            if ((o)->perf_path) bench_perf_end(&(s)->perf, OP_MIXED, (o)->n);  \
+        }                                                                      \
+    } while (0)
+
+#endif // BENCH_H
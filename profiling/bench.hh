@@ -0,0 +1,119 @@
+#ifndef BENCH_HH
+#define BENCH_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+
+#include "bench.h"
+
+// Keys and values are fixed-size byte blobs so the C++ maps store them inline
+// exactly like the swiss arrays do. 8-byte keys stay plain uint64_t, matching
+// what the original 8-byte programs hashed.
+template <size_t N> struct Blob {
+    char buf[N];
+    bool operator==(Blob const &o) const noexcept {
+        return std::memcmp(buf, o.buf, N) == 0;
+    }
+};
+
+template <size_t N> struct BlobHash {
+    size_t operator()(Blob<N> const &k) const noexcept {
+        return std::hash<std::string_view>{}(std::string_view(k.buf, N));
+    }
+};
+
+template <size_t N> struct key_type {
+    using type = Blob<N>;
+    using hash = BlobHash<N>;
+};
+template <> struct key_type<8> {
+    using type = uint64_t;
+    using hash = std::hash<uint64_t>;
+};
+
+// Counts what a container requests so -M can report it; the aliases in the
+// drivers plug this in as the map's allocator.
+template <class T> struct CountingAllocator {
+    using value_type = T;
+    CountingAllocator() noexcept = default;
+    template <class U> CountingAllocator(CountingAllocator<U> const &) noexcept {}
+    T *allocate(size_t n) {
+        bench_mem_alloc(n * sizeof(T));
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T *p, size_t n) noexcept {
+        bench_mem_free(n * sizeof(T));
+        std::allocator<T>().deallocate(p, n);
+    }
+    template <class U> bool operator==(CountingAllocator<U> const &) const noexcept { return true; }
+    template <class U> bool operator!=(CountingAllocator<U> const &) const noexcept { return false; }
+};
+
+#define BENCH_SIZES(X) X(8) X(16) X(32) X(64) X(128) X(256) X(1024)
+
+template <template <class, class, class> class Map, size_t K, size_t V>
+static void bench_run(const bench_opts_t &o, bench_data_t &d, bench_samples_t &s) {
+    using Key = typename key_type<K>::type;
+    using Val = Blob<V>;
+    Map<Key, Val, typename key_type<K>::hash> m;
+    if (o.reserve)
+        m.reserve(o.n);
+
+#define CC_PUT(k, v) m.emplace(*(const Key*)(k), *(const Val*)(v))
+#define CC_GET(k) do {                                                         \
+        auto _it = m.find(*(const Key*)(k));                                   \
+        if (_it != m.end()) bench_escape(&_it->second);                        \
+    } while (0)
+#define CC_DEL(k) m.erase(*(const Key*)(k))
+    BENCH_RUN(&o, &d, &s, m.size(), m.bucket_count(), m.load_factor(), CC_PUT, CC_GET, CC_DEL);
+#undef CC_PUT
+#undef CC_GET
+#undef CC_DEL
+}
+
+template <template <class, class, class> class Map, size_t K>
+static bool bench_dispatch_val(const bench_opts_t &o, bench_data_t &d, bench_samples_t &s) {
+    switch (o.val_size) {
+#define X(n) case n: bench_run<Map, K, n>(o, d, s); return true;
+    BENCH_SIZES(X)
+#undef X
+    }
+    return false;
+}
+
+template <template <class, class, class> class Map>
+static bool bench_dispatch(const bench_opts_t &o, bench_data_t &d, bench_samples_t &s) {
+    switch (o.key_size) {
+#define X(n) case n: return bench_dispatch_val<Map, n>(o, d, s);
+    BENCH_SIZES(X)
+#undef X
+    }
+    return false;
+}
+
+template <template <class, class, class> class Map>
+static int bench_main(int argc, char **argv) {
+    bench_opts_t o = bench_parse(argc, argv);
+    bench_data_t d;
+    bench_samples_t s;
+    bench_prepare(&o, &d);
+    bench_samples_init(&s, &o);
+
+    if (!bench_dispatch<Map>(o, d, s)) {
+#define X(n) " " #n
+        fprintf(stderr, "%s: key and value sizes must be one of" BENCH_SIZES(X) "\n", argv[0]);
+#undef X
+        return 2;
+    }
+    bench_samples_print(&s, &o);
+
+    bench_samples_release(&s);
+    bench_release(&d);
+    return 0;
+}
+
+#endif // BENCH_HH
@@ -1,111 +1,11 @@
 #include <boost/unordered_map.hpp>
-#include <chrono>
-#include <cstring>
-#include <iostream>
-#include <random>
-#include <string_view>
-#include <vector>
 
-constexpr int NOPS = 1'000'000;
-constexpr int ITERS = 1000;
+#include "bench.hh"
 
-struct Value {
-  int num;
-  char str[1024];
-};
-struct Key {
-  char buf[1024];
-  bool operator==(Key const &o) const noexcept {
-    return std::memcmp(buf, o.buf, sizeof(buf)) == 0;
-  }
-};
-struct KeyHash {
-  size_t operator()(Key const &k) const noexcept {
-    return std::hash<std::string_view>{}(
-        std::string_view(k.buf, sizeof(k.buf)));
-  }
-};
+template <class K, class V, class H>
+using boost_map = boost::unordered_map<K, V, H, std::equal_to<K>,
+                                     CountingAllocator<std::pair<const K, V>>>;
 
-struct Entry {
-    long data;
-    long unsigned count;
-};
-
-template <class T>
-__attribute__((noinline)) void doNotOptimizeAway(const T &v) {
-  asm volatile("" ::"g"(v) : "memory");
-}
-
-static void random_bytes(char *buf, size_t len, std::mt19937_64 &rng) {
-  static const char charset[] = "abcdefghijklmnopqrstuvwxyz"
-                                "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                                "0123456789";
-  std::uniform_int_distribution<size_t> dist(0, sizeof(charset) - 2);
-  for (size_t i = 0; i < len; ++i)
-    buf[i] = charset[dist(rng)];
-}
-
-int main() {
-    std::mt19937_64 rng(42);
-    std::uniform_int_distribution<size_t> idx_dist(0, NOPS - 1);
-
-    std::vector<Key> keys(NOPS);
-    std::vector<Value> vals(NOPS);
-    for (int i = 0; i < NOPS; i++) {
-        random_bytes(keys[i].buf, sizeof(keys[i].buf), rng);
-        vals[i].num = int(std::uniform_int_distribution<int>()(rng));
-        random_bytes(vals[i].str, sizeof(vals[i].str) - 1, rng);
-        vals[i].str[sizeof(vals[i].str) - 1] = '\0';
-    }
-
-    std::vector<size_t> lookup_idx(NOPS), delete_idx(NOPS);
-    for (int i = 0; i < NOPS; i++) {
-        lookup_idx[i] = idx_dist(rng);
-        delete_idx[i] = idx_dist(rng);
-    }
-
-    boost::unordered_map<Key, Value, KeyHash> m;
-    m.reserve(NOPS);
-
-    std::vector<Entry> times_ins(NOPS), times_lkp(NOPS), times_del(NOPS);
-
-    int ins_c = 0, lkp_c = 0, del_c = 0;
-
-    {
-      for (int i = 0; i < NOPS; ++i) {
-            auto t0 = std::chrono::high_resolution_clock::now();
-          m.emplace(keys[i], vals[i]);
-            auto t1 = std::chrono::high_resolution_clock::now();
-            if (i % 100 == 0) times_ins[ins_c++] = (Entry) { .data = std::chrono::duration<long, std::nano>(t1 - t0).count(), .count = m.size() };
-      }
-    }
-  
-    {
-      for (int i = 0; i < NOPS; ++i) {
-          auto t0 = std::chrono::high_resolution_clock::now();
-          auto& v = m.find(keys[lookup_idx[i]])->second;
-          doNotOptimizeAway(v);
-          auto t1 = std::chrono::high_resolution_clock::now();
-          if (i % 100 == 0) times_lkp[lkp_c++] = (Entry) { .data = std::chrono::duration<long, std::nano>(t1 - t0).count(), .count = m.size() };
-      }
-    }
-  
-    {
-      for (int i = 0; i < NOPS; ++i) {
-          auto t0 = std::chrono::high_resolution_clock::now();
-          m.erase(keys[delete_idx[i]]);
-          auto t1 = std::chrono::high_resolution_clock::now();
-          if (i % 100 == 0) times_del[del_c++] = (Entry) { .data = std::chrono::duration<long, std::nano>(t1 - t0).count(), .count = m.size() };
-      }
-    }
-  
-    std::cout << "operation,avg_ns,count\n";
-    for (int i = 0; i < ins_c; ++i)
-        std::cout << "Insert," << times_ins[i].data << "," << times_ins[i].count << "\n";
-    for (int i = 0; i < lkp_c; ++i)
-        std::cout << "Lookup," << times_lkp[i].data << "," << times_lkp[i].count << "\n";
-    for (int i = 0; i < del_c; ++i)
-        std::cout << "Delete," << times_del[i].data << "," << times_del[i].count << "\n";
-
-  return 0;
+int main(int argc, char **argv) {
+    return bench_main<boost_map>(argc, argv);
 }
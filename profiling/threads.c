@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hash.h"
+#include "../xxhash3.h"
+#include "bench.h"
+
+// Aggregate throughput against thread count for the ways a single-threaded
+// map can be used from many cores today:
+//   shared-lookup   lookups on one prebuilt map shared by every thread
+//   private-insert  each thread fills its own map with its slice of the keys
+//   private-lookup  lookups, each thread in its own map
+//   rwlock          shared map, writes under a pthread_rwlock write lock
+//   mutex           shared map, every operation under one pthread_mutex
+// Every thread performs n operations per mode except private-insert, where
+// the n keys are split between the threads.
+
+#define MAX_THREADS 256
+
+enum { MODE_SHARED, MODE_PRIV_INSERT, MODE_PRIV_LOOKUP, MODE_RWLOCK, MODE_MUTEX, MODE_COUNT };
+static const char *const mode_names[MODE_COUNT] = {
+    "shared-lookup", "private-insert", "private-lookup", "rwlock", "mutex"
+};
+
+static uint32_t thread_counts[32] = { 1, 2, 4, 8 }, nthread_counts = 4;
+static uint32_t write_pct = 10;
+
+static int threads_opt(int c, const char *arg) {
+    switch (c) {
+    case 'T':
+        nthread_counts = 0;
+        for (const char *p = arg; *p && nthread_counts < 32; p = strchr(p, ',') ? strchr(p, ',') + 1 : "") {
+            uint32_t t = strtoul(p, NULL, 0);
+            if (!t || t > MAX_THREADS) return -1;
+            thread_counts[nthread_counts++] = t;
+        }
+        return nthread_counts ? 0 : -1;
+    case 'W':
+        write_pct = strtoul(arg, NULL, 0);
+        return write_pct > 100;
+    }
+    return -1;
+}
+
+sm_allocator_t newhash(sm_allocator_t a) {
+    a.hash = XXH3_64bits;
+    return a;
+}
+
+typedef struct {
+    const bench_opts_t *o;
+    const bench_data_t *d;
+    pthread_barrier_t *ready, *start;
+    void *shared;
+    void *priv;
+    pthread_rwlock_t *rw;
+    pthread_mutex_t *mu;
+    int mode;
+    uint32_t id, nthreads;
+} worker_t;
+
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    const bench_opts_t *o = w->o;
+    const bench_data_t *d = w->d;
+    uint64_t ks = o->key_size, vs = o->val_size;
+    uint64_t off = (uint64_t)w->id * o->n / w->nthreads;
+    uint64_t lo = off, hi = (uint64_t)(w->id + 1) * o->n / w->nthreads;
+    int ins;
+
+    if (w->mode == MODE_PRIV_INSERT || w->mode == MODE_PRIV_LOOKUP) {
+        w->priv = sm_new(hi - lo + (hi - lo) / 4 + 1, ks, vs, newhash(sm_mmap_allocator()));
+        if (w->mode == MODE_PRIV_LOOKUP)
+            for (uint64_t i = lo; i < hi; i++)
+                memcpy(sm_get(w->priv, BENCH_KEY(o, d, i), &ins, ks, vs), BENCH_VAL(o, d, i), vs);
+    }
+    pthread_barrier_wait(w->ready);
+    pthread_barrier_wait(w->start);
+
+    switch (w->mode) {
+    case MODE_SHARED:
+        for (uint64_t i = 0; i < o->n; i++)
+            bench_escape(sm_find(w->shared, BENCH_KEY(o, d, d->lookup[(off + i) % o->n]), ks, vs));
+        break;
+    case MODE_PRIV_INSERT:
+        for (uint64_t i = lo; i < hi; i++)
+            memcpy(sm_get(w->priv, BENCH_KEY(o, d, i), &ins, ks, vs), BENCH_VAL(o, d, i), vs);
+        break;
+    case MODE_PRIV_LOOKUP:
+        for (uint64_t i = 0; i < o->n; i++)
+            bench_escape(sm_find(w->priv, BENCH_KEY(o, d, lo + d->lookup[(off + i) % o->n] % (hi - lo)), ks, vs));
+        break;
+    case MODE_RWLOCK:
+    case MODE_MUTEX:
+        for (uint64_t i = 0; i < o->n; i++) {
+            uint32_t k = d->lookup[(off + i) % o->n];
+            int write = d->erase[(off + i) % o->n] % 100 < write_pct;
+            if (w->mode == MODE_MUTEX) pthread_mutex_lock(w->mu);
+            else if (write) pthread_rwlock_wrlock(w->rw);
+            else pthread_rwlock_rdlock(w->rw);
+            if (write)
+                memcpy(sm_get(w->shared, BENCH_KEY(o, d, k), &ins, ks, vs), BENCH_VAL(o, d, i), vs);
+            else
+                bench_escape(sm_find(w->shared, BENCH_KEY(o, d, k), ks, vs));
+            if (w->mode == MODE_MUTEX) pthread_mutex_unlock(w->mu);
+            else pthread_rwlock_unlock(w->rw);
+        }
+        break;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    bench_extra_opts = "T:W:";
+    bench_extra_usage =
+        "  -T  comma separated thread counts (default 1,2,4,8)\n"
+        "  -W  percentage of writes in the rwlock/mutex modes (default 10)\n";
+    bench_extra_opt = threads_opt;
+    bench_opts_t o = bench_parse(argc, argv);
+    bench_data_t d;
+    bench_prepare(&o, &d);
+
+    void *shared = sm_new(o.n + o.n / 4 + 1, o.key_size, o.val_size, newhash(sm_mmap_allocator()));
+    for (uint64_t i = 0; i < o.n; i++) {
+        int ins;
+        memcpy(sm_get(shared, BENCH_KEY(&o, &d, i), &ins, o.key_size, o.val_size),
+               BENCH_VAL(&o, &d, i), o.val_size);
+    }
+
+    printf("mode,threads,ops,ns,ops_per_sec\n");
+    for (int mode = 0; mode < MODE_COUNT; mode++) {
+        for (uint32_t t = 0; t < nthread_counts; t++) {
+            uint32_t nt = thread_counts[t];
+            pthread_t tids[MAX_THREADS];
+            worker_t ws[MAX_THREADS];
+            pthread_barrier_t ready, start;
+            pthread_rwlock_t rw = PTHREAD_RWLOCK_INITIALIZER;
+            pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+            pthread_barrier_init(&ready, NULL, nt + 1);
+            pthread_barrier_init(&start, NULL, nt + 1);
+
+            for (uint32_t i = 0; i < nt; i++) {
+                ws[i] = (worker_t) {
+                    .o = &o, .d = &d, .ready = &ready, .start = &start, .shared = shared,
+                    .rw = &rw, .mu = &mu, .mode = mode, .id = i, .nthreads = nt,
+                };
+                pthread_create(&tids[i], NULL, worker, &ws[i]);
+            }
+            // ready holds the clock until every worker has finished its
+            // untimed setup; it is read before start releases them, since
+            // with fewer cores than threads the workers may otherwise run
+            // to completion before the main thread is scheduled again
+            pthread_barrier_wait(&ready);
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            pthread_barrier_wait(&start);
+            for (uint32_t i = 0; i < nt; i++)
+                pthread_join(tids[i], NULL);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+
+            uint64_t ops = mode == MODE_PRIV_INSERT ? o.n : o.n * nt;
+            long ns = ns_diff(&t0, &t1);
+            printf("%s,%u,%lu,%ld,%.0f\n", mode_names[mode], nt, (unsigned long)ops, ns,
+                   (double)ops * 1e9 / (double)ns);
+            fflush(stdout);
+
+            for (uint32_t i = 0; i < nt; i++)
+                if (ws[i].priv) sm_free(ws[i].priv, newhash(sm_mmap_allocator()));
+            pthread_barrier_destroy(&ready);
+            pthread_barrier_destroy(&start);
+        }
+    }
+
+    sm_free(shared, newhash(sm_mmap_allocator()));
+    bench_release(&d);
+    return 0;
+}
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""Compare the swiss driver against a stored baseline.
+
+    python3 regress.py baseline            # run the workloads, store results
+    python3 regress.py compare             # run again, test against them
+
+Each workload runs --trials times in throughput mode with -J, so every trial
+yields one ns/op figure per operation. compare flags an operation when its
+median got slower by more than --threshold percent and a two-sided
+Mann-Whitney U test on the trials rejects "same distribution" at --alpha;
+the exit status is 1 if anything regressed. Only the standard library is
+used so this runs on machines without the plotting stack.
+"""
+
+import argparse
+import json
+import math
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+# name, driver arguments (-t and -J are added by the runner)
+workloads = [
+    ("k8v8",     ["-k", "8",  "-v", "8",  "-n", "1000000", "-r"]),
+    ("k8v8x50",  ["-k", "8",  "-v", "8",  "-n", "1000000", "-r", "-x", "50"]),
+    ("k8v8d50",  ["-k", "8",  "-v", "8",  "-n", "1000000", "-r", "-D", "50", "-x", "50"]),
+    ("k8v8g",    ["-k", "8",  "-v", "8",  "-n", "1000000"]),
+    ("k16v64",   ["-k", "16", "-v", "64", "-n", "1000000", "-r"]),
+    ("k32v8",    ["-k", "32", "-v", "8",  "-n", "1000000", "-r"]),
+    ("k8v8r",    ["-k", "8",  "-v", "8",  "-n", "1000000", "-r", "-m", "1:1:1"]),
+]
+
+build_dir = ".temp"
+driver    = os.path.join(build_dir, "regress_swiss")
+build_cmd = ["gcc", "-O3", "-march=native", "profiling/swiss.c", "hash.c", "xxhash3.c",
+             "-o", driver, "-lm", "-pthread"]
+
+
+def build():
+    os.makedirs(build_dir, exist_ok=True)
+    subprocess.run(build_cmd, check=True)
+
+
+def run_trials(args, trials, batch):
+    """ns/op per operation for each trial: {operation: [float, ...]}."""
+    out = {}
+    with tempfile.TemporaryDirectory() as tmp:
+        fn = os.path.join(tmp, "run.json")
+        for _ in range(trials):
+            subprocess.run([driver] + args + ["-t", str(batch), "-J", fn],
+                           check=True, stdout=subprocess.DEVNULL)
+            with open(fn) as f:
+                for r in json.load(f)["results"]:
+                    out.setdefault(r["operation"], []).append(r["ns_per_op"])
+    return out
+
+
+def run_all(trials, batch, only):
+    results = {}
+    for name, args in workloads:
+        if only and name not in only:
+            continue
+        print(f"{name}: {trials} trials", file=sys.stderr)
+        results[name] = {"args": args, "ops": run_trials(args, trials, batch)}
+    return results
+
+
+def mann_whitney(a, b):
+    """Two-sided p-value of the Mann-Whitney U test, normal approximation
+    with tie correction. Good enough from about 8 samples per side."""
+    n1, n2 = len(a), len(b)
+    pooled = sorted([(v, 0) for v in a] + [(v, 1) for v in b])
+    ranks = [0.0] * len(pooled)
+    ties = 0.0
+    i = 0
+    while i < len(pooled):
+        j = i
+        while j + 1 < len(pooled) and pooled[j + 1][0] == pooled[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2 + 1
+        t = j - i + 1
+        ties += t ** 3 - t
+        i = j + 1
+    r1 = sum(r for r, (_, side) in zip(ranks, pooled) if side == 0)
+    u = r1 - n1 * (n1 + 1) / 2
+    n = n1 + n2
+    var = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)))
+    if var <= 0:
+        return 1.0
+    z = (abs(u - n1 * n2 / 2) - 0.5) / math.sqrt(var)
+    return min(1.0, 2 * (1 - statistics.NormalDist().cdf(max(z, 0.0))))
+
+
+def compare(base, new, threshold, alpha):
+    regressed = False
+    headers = ["Workload", "Operation", "Base (ns)", "New (ns)", "Change", "p", ""]
+    print("| " + " | ".join(headers) + " |")
+    print("| " + " | ".join("---" for _ in headers) + " |")
+    for name, cur in new.items():
+        if name not in base:
+            continue
+        if base[name]["args"] != cur["args"]:
+            print(f"{name}: arguments differ from the baseline, skipped", file=sys.stderr)
+            continue
+        for op, samples in cur["ops"].items():
+            ref = base[name]["ops"].get(op)
+            if not ref:
+                continue
+            m0, m1 = statistics.median(ref), statistics.median(samples)
+            change = (m1 - m0) / m0 * 100
+            p = mann_whitney(ref, samples)
+            flag = ""
+            if p < alpha and change > threshold:
+                flag, regressed = "REGRESSION", True
+            elif p < alpha and change < -threshold:
+                flag = "faster"
+            print(f"| {name} | {op} | {m0:.2f} | {m1:.2f} | {change:+.1f}% | {p:.3g} | {flag} |")
+    return regressed
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("command", choices=["baseline", "compare"])
+    ap.add_argument("--file", default="baseline.json", help="baseline to write or compare against")
+    ap.add_argument("--trials", type=int, default=10)
+    ap.add_argument("--batch", type=int, default=1000, help="ops per timed batch")
+    ap.add_argument("--threshold", type=float, default=5.0, help="percent slowdown to flag")
+    ap.add_argument("--alpha", type=float, default=0.01, help="significance level")
+    ap.add_argument("--only", nargs="*", help="workload names to run")
+    ap.add_argument("--no-build", action="store_true", help=f"reuse {driver}")
+    a = ap.parse_args()
+
+    if not a.no_build:
+        build()
+    results = run_all(a.trials, a.batch, a.only)
+
+    if a.command == "baseline":
+        with open(a.file, "w") as f:
+            json.dump({"build": " ".join(build_cmd), "trials": a.trials, "batch": a.batch,
+                       "workloads": results}, f, indent=1)
+        print(f"wrote {a.file}", file=sys.stderr)
+        return 0
+
+    with open(a.file) as f:
+        base = json.load(f)
+    return 1 if compare(base["workloads"], results, a.threshold, a.alpha) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,358 @@
+// Checks for the persistence, sharing and copying APIs. Run by
+// branch-test.sh; prints each failed check and exits non-zero if any failed.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "hash.h"
+#include "xxhash3.h"
+
+static int failures;
+#define CHECK(cond) do {                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n",                  \
+                    __FILE__, __LINE__, __func__, #cond);                      \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+static char dir[] = "/tmp/swissmap-test.XXXXXX";
+static char snap_path[64], delta_path[64], log_path[64], pfile_path[64];
+
+static sm_allocator_t xxh3_alloc(void) {
+    sm_allocator_t a = sm_mmap_allocator();
+    a.hash = XXH3_64bits;
+    return a;
+}
+
+static void put_u64(void *m, uint64_t k, uint64_t v) {
+    int ins;
+    uint64_t *slot = sm_get(m, &k, &ins, 8, 8);
+    CHECK(slot);
+    if (slot) *slot = v;
+}
+
+// 1 if both maps hold exactly the same entries.
+static int same_entries(void *a, void *b) {
+    sm_iter_t it;
+    void *k, *v;
+    uint64_t n = 0;
+    int ok = 1;
+    sm_iter_begin(a, &it, 8, 8);
+    while (sm_iter_next(&it, &k, &v)) {
+        uint64_t *w = sm_find(b, k, 8, 8);
+        ok &= w && *w == *(uint64_t*)v;
+        n++;
+    }
+    sm_iter_begin(b, &it, 8, 8);
+    while (sm_iter_next(&it, &k, &v))
+        n--;
+    return ok && n == 0;
+}
+
+static void *filled(uint64_t n, uint64_t mul) {
+    void *m = sm_new(16, 8, 8, xxh3_alloc());
+    for (uint64_t i = 0; i < n; i++)
+        put_u64(m, i, i * mul);
+    return m;
+}
+
+static void test_save_open(void) {
+    void *m = filled(50000, 3);
+    for (uint64_t i = 0; i < 50000; i += 3)
+        sm_delete(m, &i, 8, 8);
+    CHECK(sm_save(m, snap_path, SM_HASH_XXH3, 8, 8) == 0);
+
+    void *o = sm_open(snap_path, xxh3_alloc(), SM_HASH_XXH3, 0, 8, 8);
+    CHECK(o && same_entries(m, o));
+    if (o) {
+        put_u64(o, 1 << 30, 1); // copy-on-write, then grows off the mapping
+        for (uint64_t i = 0; i < 100000; i++)
+            put_u64(o, (1ull << 31) + i, i);
+        sm_free(o, xxh3_alloc());
+    }
+    o = sm_open(snap_path, xxh3_alloc(), SM_HASH_XXH3, SM_OPEN_READONLY, 8, 8);
+    CHECK(o && same_entries(m, o));
+    if (o) sm_free(o, xxh3_alloc());
+
+    errno = 0;
+    CHECK(!sm_open(snap_path, xxh3_alloc(), SM_HASH_FNV1A, 0, 8, 8) && errno == EINVAL);
+    CHECK(!sm_open(snap_path, xxh3_alloc(), SM_HASH_XXH3, 0, 8, 16) && errno == EINVAL);
+    sm_free(m, xxh3_alloc());
+    unlink(snap_path);
+}
+
+static void test_pfile(void) {
+    unlink(pfile_path);
+    sm_pfile_t *f = sm_pfile_open(pfile_path, 1ull << 30);
+    CHECK(f);
+    if (!f) return;
+    void *m = sm_pfile_map(f, 16, XXH3_64bits, SM_HASH_XXH3, 8, 8);
+    for (uint64_t i = 0; i < 100000; i++)
+        put_u64(m, i, i * 7);
+    for (uint64_t i = 0; i < 100000; i += 4)
+        sm_delete(m, &i, 8, 8);
+    CHECK(!sm_pfile_open(pfile_path, 1ull << 30)); // locked while open
+    CHECK(sm_pfile_close(f) == 0);
+
+    f = sm_pfile_open(pfile_path, 1ull << 30);
+    CHECK(f);
+    if (!f) return;
+    errno = 0;
+    CHECK(!sm_pfile_map(f, 16, XXH3_64bits, SM_HASH_XXH3, 8, 16) && errno == EINVAL);
+    m = sm_pfile_map(f, 16, XXH3_64bits, SM_HASH_XXH3, 8, 8);
+    CHECK(m);
+    int ok = 1;
+    for (uint64_t i = 0; m && i < 100000; i++) {
+        uint64_t *v = sm_find(m, &i, 8, 8);
+        ok &= i % 4 ? v && *v == i * 7 : !v;
+    }
+    CHECK(ok);
+    CHECK(sm_pfile_close(f) == 0);
+    unlink(pfile_path);
+
+    // out of space: a map too big for the file, then a grow that cannot fit
+    f = sm_pfile_open(pfile_path, 1 << 20);
+    CHECK(f);
+    if (!f) return;
+    errno = 0;
+    CHECK(!sm_pfile_map(f, 1 << 20, XXH3_64bits, SM_HASH_XXH3, 8, 8) && errno == ENOMEM);
+    m = sm_pfile_map(f, 1024, XXH3_64bits, SM_HASH_XXH3, 8, 8);
+    CHECK(m);
+    uint64_t n = 0;
+    int ins;
+    for (uint64_t *v; m && (v = sm_get(m, &n, &ins, 8, 8)); n++)
+        *v = n;
+    CHECK(errno == ENOMEM && n > 1000 && n < (1 << 20) / 16);
+    ok = 1;
+    for (uint64_t i = 0; m && i < n; i++) {
+        uint64_t *v = sm_find(m, &i, 8, 8);
+        ok &= v && *v == i;
+    }
+    CHECK(ok);
+    CHECK(sm_pfile_close(f) == 0);
+    unlink(pfile_path);
+}
+
+static void test_shm(void) {
+    int fd = memfd_create("swissmap-test", 0);
+    CHECK(fd >= 0);
+    if (fd < 0) return;
+    sm_shm_t *w = sm_shm_create(fd, 1000, XXH3_64bits, SM_HASH_XXH3, 8, 8);
+    CHECK(w);
+    if (!w) return;
+    uint64_t k, v;
+    for (k = 0; k < 1000; k++)
+        CHECK(sm_shm_put(w, &k, &k) == 1);
+    errno = 0;
+    CHECK(sm_shm_put(w, &k, &k) == -1 && errno == ENOSPC);
+    v = 5;
+    k = 0;
+    CHECK(sm_shm_put(w, &k, &v) == 0);
+    CHECK(sm_shm_size(w) == 1000);
+
+    // churn at the limit: every delete makes room for exactly one new key,
+    // and the tombstones are rehashed away along the way
+    uint64_t lo = 1, hi = 1000;
+    for (int i = 0; i < 20000; i++, lo++, hi++) {
+        CHECK(sm_shm_delete(w, &lo) == 0);
+        CHECK(sm_shm_put(w, &hi, &hi) == 1);
+    }
+    sm_shm_t *r = sm_shm_attach(fd, XXH3_64bits, SM_HASH_XXH3, 0, 8, 8);
+    CHECK(r);
+    int ok = 1;
+    for (k = lo; r && k < hi; k++)
+        ok &= sm_shm_find(r, &k, &v) == 1 && v == k;
+    CHECK(ok);
+    k = 1;
+    CHECK(r && sm_shm_find(r, &k, NULL) == 0);
+    if (r) {
+        errno = 0;
+        CHECK(sm_shm_put(r, &k, &k) == -1 && errno == EBADF);
+        sm_shm_detach(r);
+    }
+    sm_shm_detach(w);
+    close(fd);
+}
+
+// Few enough changes that sm_checkpoint writes a delta.
+static void churn(void *m, unsigned seed) {
+    srand(seed);
+    for (int j = 0; j < 60; j++)
+        put_u64(m, (uint64_t)rand() % 200000, seed);
+    for (int j = 0; j < 10; j++) {
+        uint64_t k = (uint64_t)rand() % 200000;
+        sm_delete(m, &k, 8, 8);
+    }
+}
+
+// Runs a checkpoint in a child that is killed (SIGXFSZ) once it has written
+// limit bytes to any one file, as if the machine went down mid-write.
+static void interrupted_checkpoint(void *m, rlim_t limit) {
+    pid_t p = fork();
+    if (!p) {
+        struct rlimit rl = { limit, limit };
+        setrlimit(RLIMIT_FSIZE, &rl);
+        sm_checkpoint(m, snap_path, SM_HASH_XXH3, 8, 8);
+        _exit(0);
+    }
+    int st;
+    waitpid(p, &st, 0);
+    CHECK(WIFSIGNALED(st));
+}
+
+static void check_replay(void *m) {
+    void *r = sm_wal_replay(snap_path, log_path, xxh3_alloc(), SM_HASH_XXH3, 8, 8);
+    CHECK(r && same_entries(m, r));
+    if (r) sm_free(r, xxh3_alloc());
+}
+
+static void test_checkpoint_wal(void) {
+    unlink(snap_path);
+    unlink(log_path);
+    void *m = filled(100000, 1);
+    CHECK(sm_track_dirty(m, 256) == 0);
+    sm_wal_t *w = sm_wal_open(log_path, 1 << 16, 8, 8);
+    CHECK(w);
+    if (!w) return;
+    CHECK(sm_wal_attach(m, w) == 0);
+    CHECK(sm_checkpoint(m, snap_path, SM_HASH_XXH3, 8, 8) == 0);
+    CHECK(sm_wal_reset(w) == 0);
+
+    // incremental checkpoints, each followed by a log reset
+    for (unsigned round = 1; round <= 3; round++) {
+        churn(m, round);
+        CHECK(sm_checkpoint(m, snap_path, SM_HASH_XXH3, 8, 8) == 0);
+        CHECK(sm_wal_reset(w) == 0);
+        CHECK(access(delta_path, F_OK) == 0);
+        void *o = sm_open(snap_path, xxh3_alloc(), SM_HASH_XXH3, SM_OPEN_READONLY, 8, 8);
+        CHECK(o && same_entries(m, o));
+        if (o) sm_free(o, xxh3_alloc());
+    }
+
+    // committed changes since the last checkpoint come back from the log,
+    // whether a checkpoint was interrupted writing a delta or a full file
+    churn(m, 4);
+    CHECK(sm_wal_commit(w) == 0);
+    check_replay(m);
+    interrupted_checkpoint(m, 4096);
+    check_replay(m);
+    for (uint64_t i = 0; i < 200000; i++) // enough to need a full write
+        put_u64(m, i, i * 5);
+    CHECK(sm_wal_commit(w) == 0);
+    interrupted_checkpoint(m, 1 << 20);
+    check_replay(m);
+
+    CHECK(sm_checkpoint(m, snap_path, SM_HASH_XXH3, 8, 8) == 0);
+    CHECK(sm_wal_reset(w) == 0);
+    check_replay(m);
+    CHECK(sm_free(m, xxh3_alloc()) == 0);
+    CHECK(sm_wal_close(w) == 0);
+    unlink(snap_path);
+    unlink(delta_path);
+    unlink(log_path);
+}
+
+static void test_freeze(void) {
+    uint64_t sizes[] = { 0, 1, 31, 1000, 200000 };
+    for (int s = 0; s < 5; s++) {
+        void *m = filled(sizes[s], 3);
+        sm_frozen_t *f = sm_freeze(m, 8, 8);
+        CHECK(f);
+        if (!f) continue;
+        int ok = 1;
+        for (uint64_t i = 0; i < sizes[s]; i++) {
+            const uint64_t *v = sm_frozen_find(f, &i);
+            ok &= v && *v == i * 3;
+        }
+        for (uint64_t i = sizes[s]; i < sizes[s] + 10000; i++)
+            ok &= !sm_frozen_find(f, &i);
+        CHECK(ok);
+        sm_stats_t st;
+        sm_frozen_stats(f, &st);
+        CHECK(st.size == sizes[s]);
+        sm_frozen_free(f);
+        sm_free(m, xxh3_alloc());
+    }
+}
+
+static void add_values(void *dst_val, const void *src_val, const void *key, void *ctx) {
+    (void)key;
+    (void)ctx;
+    *(uint64_t*)dst_val += *(const uint64_t*)src_val;
+}
+
+static void test_clone_merge(void) {
+    void *m = filled(100000, 2);
+    for (uint64_t i = 0; i < 100000; i += 5)
+        sm_delete(m, &i, 8, 8);
+    void *c = sm_clone(m, 8, 8);
+    CHECK(c && same_entries(m, c));
+    if (c) {
+        put_u64(c, 1, 12345); // the copy is independent
+        CHECK(*(uint64_t*)sm_find(m, &(uint64_t){1}, 8, 8) == 2);
+        sm_free(c, xxh3_alloc());
+    }
+
+    // src holds [50000, 150000) with value 1; dst holds [0, 100000) minus
+    // every fifth key, with value 2k
+    void *src = sm_new(16, 8, 8, xxh3_alloc());
+    for (uint64_t i = 50000; i < 150000; i++)
+        put_u64(src, i, 1);
+    int policies[] = { SM_MERGE_KEEP, SM_MERGE_OVERWRITE, SM_MERGE_COMBINE };
+    for (int p = 0; p < 3; p++) {
+        void *d = sm_clone(m, 8, 8);
+        uint64_t added = sm_merge(d, src, policies[p], add_values, NULL, 8, 8);
+        CHECK(added == 50000 + 10000);
+        int ok = 1;
+        for (uint64_t i = 0; i < 150000; i++) {
+            uint64_t *v = sm_find(d, &i, 8, 8), want;
+            int in_dst = i < 100000 && i % 5, in_src = i >= 50000;
+            if (!in_dst && !in_src) {
+                ok &= !v;
+                continue;
+            }
+            if (!in_dst) want = 1;
+            else if (!in_src) want = i * 2;
+            else want = policies[p] == SM_MERGE_KEEP ? i * 2
+                      : policies[p] == SM_MERGE_OVERWRITE ? 1 : i * 2 + 1;
+            ok &= v && *v == want;
+        }
+        CHECK(ok);
+        sm_free(d, xxh3_alloc());
+    }
+    sm_free(src, xxh3_alloc());
+    sm_free(m, xxh3_alloc());
+}
+
+int main(void) {
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(snap_path, sizeof(snap_path), "%s/map.snap", dir);
+    snprintf(delta_path, sizeof(delta_path), "%s/map.snap.delta", dir);
+    snprintf(log_path, sizeof(log_path), "%s/map.wal", dir);
+    snprintf(pfile_path, sizeof(pfile_path), "%s/map.pf", dir);
+
+    test_save_open();
+    test_pfile();
+    test_shm();
+    test_checkpoint_wal();
+    test_freeze();
+    test_clone_merge();
+
+    rmdir(dir);
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
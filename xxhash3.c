@@ -2,6 +2,8 @@
 #include <stddef.h>
 #include <string.h>
 
+#include "xxhash3.h"
+
 #ifndef XXH3_USE_SCALAR
 # if defined(__AVX2__)
 #   include <immintrin.h>
@@ -37,6 +39,8 @@ static const uint8_t XXH3_kSecret[192] = {
 
 #if defined(XXH3_USE_AVX2)
 
+/* acc need not be aligned: a caller's XXH3_state_t may come from malloc or a
+   packed struct */
 static void accumulate512(uint64_t acc[8], const uint8_t *in, const uint8_t *sec) {
     __m256i *xacc    = (__m256i*)acc;
     const __m256i *xinp = (const __m256i*)in;
@@ -49,8 +53,8 @@ static void accumulate512(uint64_t acc[8], const uint8_t *in, const uint8_t *sec
         __m256i lo   = _mm256_shuffle_epi32(dk, _MM_SHUFFLE(0,3,0,1));
         __m256i prod = _mm256_mul_epu32(dk, lo);
         __m256i swap = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1,0,3,2));
-        __m256i sum  = _mm256_add_epi64(xacc[i], swap);
-        xacc[i]      = _mm256_add_epi64(sum, prod);
+        __m256i sum  = _mm256_add_epi64(_mm256_loadu_si256(xacc + i), swap);
+        _mm256_storeu_si256(xacc + i, _mm256_add_epi64(sum, prod));
     }
 }
 
@@ -68,8 +72,8 @@ static void accumulate512(uint64_t acc[8], const uint8_t *in, const uint8_t *sec
         __m128i lo   = _mm_shuffle_epi32(dk, _MM_SHUFFLE(0,3,0,1));
         __m128i prod = _mm_mul_epu32(dk, lo);
         __m128i swap = _mm_shuffle_epi32(data, _MM_SHUFFLE(1,0,3,2));
-        __m128i sum  = _mm_add_epi64(xacc[i], swap);
-        xacc[i]      = _mm_add_epi64(sum, prod);
+        __m128i sum  = _mm_add_epi64(_mm_loadu_si128(xacc + i), swap);
+        _mm_storeu_si128(xacc + i, _mm_add_epi64(sum, prod));
     }
 }
 
@@ -120,7 +124,8 @@ static uint64_t xxh3_len_17to128(const uint8_t *p, uint64_t len) {
     uint64_t acc = len * 0x9E3779B185EBCA87ULL;
     uint64_t n = (len - 1) / 16;
     for (uint64_t i = 0; i <= n; i++) {
-        const uint8_t *c = p + 16*i;
+        /* a partial last chunk overlaps the tail instead of reading past it */
+        const uint8_t *c = 16*i + 16 <= len ? p + 16*i : p + len - 16;
         uint64_t lo = read64(c)     ^ (read64(XXH3_kSecret+16*i)     + acc);
         uint64_t hi = read64(c + 8) ^ (read64(XXH3_kSecret+16*i + 8) - acc);
         acc += rotl64(lo * hi, 31);
@@ -144,17 +149,14 @@ static uint64_t xxh3_len_129to240(const uint8_t *p, uint64_t len) {
 }
 
 /*— regime-4: >240 bytes —*/
-static uint64_t xxh3_hashLong_64b(const uint8_t *p, uint64_t len) {
-    uint64_t acc[8] = {
-        0x9E3779B185EBCA87ULL,0xC2B2AE3D27D4EB4FULL,
-        0x165667B19E3779F9ULL,0x85EBCA77C2B2AE63ULL,
-        0x27D4EB2F165667C5ULL,0x9E3779B185EBCA87ULL,
-        0xC2B2AE3D27D4EB4FULL,0x165667B19E3779F9ULL
-    };
-    uint64_t stripes = len / 64;
-    for (uint64_t s = 0; s < stripes; s++) {
-        accumulate512(acc, p + s*64, XXH3_kSecret);
-    }
+static const uint64_t XXH3_kInitAcc[8] = {
+    0x9E3779B185EBCA87ULL,0xC2B2AE3D27D4EB4FULL,
+    0x165667B19E3779F9ULL,0x85EBCA77C2B2AE63ULL,
+    0x27D4EB2F165667C5ULL,0x9E3779B185EBCA87ULL,
+    0xC2B2AE3D27D4EB4FULL,0x165667B19E3779F9ULL
+};
+
+static uint64_t xxh3_mergeAccs(const uint64_t acc[8], uint64_t len) {
     uint64_t h = len * 0x9E3779B185EBCA87ULL;
     for (int i = 0; i < 8; i++) {
         h += acc[i] ^ read64(XXH3_kSecret + 64 + i*8);
@@ -166,6 +168,16 @@ static uint64_t xxh3_hashLong_64b(const uint8_t *p, uint64_t len) {
     return h;
 }
 
+static uint64_t xxh3_hashLong_64b(const uint8_t *p, uint64_t len) {
+    uint64_t acc[8] __attribute__((aligned(64)));
+    memcpy(acc, XXH3_kInitAcc, sizeof(acc));
+    uint64_t stripes = len / 64;
+    for (uint64_t s = 0; s < stripes; s++) {
+        accumulate512(acc, p + s*64, XXH3_kSecret);
+    }
+    return xxh3_mergeAccs(acc, len);
+}
+
 uint64_t XXH3_64bits(const void *data, uint64_t len) {
     const uint8_t *p = (const uint8_t*)data;
     if (len <= 16)  return xxh3_len_0to16    (p,len);
@@ -173,3 +185,50 @@ uint64_t XXH3_64bits(const void *data, uint64_t len) {
     if (len <= 240) return xxh3_len_129to240 (p,len);
     return xxh3_hashLong_64b(p,len);
 }
+
+
+/*— streaming: buffer until the regime is known, then fold whole stripes —*/
+void XXH3_64bits_init(XXH3_state_t *state) {
+    memcpy(state->acc, XXH3_kInitAcc, sizeof(state->acc));
+    state->total = 0;
+    state->buffered = 0;
+}
+
+void XXH3_64bits_update(XXH3_state_t *state, const void *data, uint64_t len) {
+    const uint8_t *p = (const uint8_t*)data;
+    if (state->total + len <= 240) {
+        memcpy(state->buffer + state->buffered, p, len);
+        state->buffered += len;
+        state->total += len;
+        return;
+    }
+    if (state->total <= 240) {
+        /* crossing into regime-4: drain the short-input buffer as stripes */
+        uint64_t stripes = state->buffered / 64;
+        for (uint64_t s = 0; s < stripes; s++)
+            accumulate512(state->acc, state->buffer + s*64, XXH3_kSecret);
+        state->buffered -= stripes * 64;
+        memmove(state->buffer, state->buffer + stripes*64, state->buffered);
+    }
+    state->total += len;
+    if (state->buffered) {
+        uint64_t fill = 64 - state->buffered;
+        if (fill > len) fill = len;
+        memcpy(state->buffer + state->buffered, p, fill);
+        state->buffered += fill;
+        p += fill; len -= fill;
+        if (state->buffered < 64) return;
+        accumulate512(state->acc, state->buffer, XXH3_kSecret);
+        state->buffered = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        accumulate512(state->acc, p, XXH3_kSecret);
+    memcpy(state->buffer, p, len);
+    state->buffered = len;
+}
+
+uint64_t XXH3_64bits_digest(const XXH3_state_t *state) {
+    if (state->total <= 240)
+        return XXH3_64bits(state->buffer, state->total);
+    return xxh3_mergeAccs(state->acc, state->total);
+}
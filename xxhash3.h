@@ -2,5 +2,17 @@
 #define XXHASH3_H_
 #include <stdint.h>
 
+typedef struct {
+    uint64_t acc[8];
+    uint64_t total;
+    uint64_t buffered;
+    uint8_t buffer[240];
+} XXH3_state_t;
+
 uint64_t XXH3_64bits(const void *data, uint64_t len);
+
+/* Streaming form: digest equals XXH3_64bits over the concatenated input. */
+void XXH3_64bits_init(XXH3_state_t *state);
+void XXH3_64bits_update(XXH3_state_t *state, const void *data, uint64_t len);
+uint64_t XXH3_64bits_digest(const XXH3_state_t *state);
 #endif